@@ -16,31 +16,100 @@
 #include "dfloat.h"
 
 // Types for CSV fields
-enum types { csv_number, csv_string };
+enum types { csv_number, csv_string, csv_int64, csv_double };
+
+// Narrowest storage that holds every sampled value of a number field;
+// csv_dfloat64 is the storage actually used for numbers
+enum widths { csv_dfloat64, csv_integer32, csv_integer64, csv_dfloat16, csv_dfloat32, csv_dfloat128 };
+
+// Default number of lines examined to infer the types of the fields
+#define CSV_SAMPLE_ROWS 1000
+
+// Default accuracy of quantile sketches, which estimate ranks to
+// within about 1.7 / CSV_SKETCH_K of the number of values
+#define CSV_SKETCH_K 200
 
 // Conditional operators for selecting records
 enum operators { EQ, NE, LT, GT, LE, GE, SEQ, SNE, MOD };
 
+// Sort directions for csv_sort_table()
+enum directions { ASC, DESC };
+
+// Join types for csv_join()
+enum joins { INNER_JOIN, LEFT_JOIN };
+
+// Element orders for csv_to_matrix()
+enum layouts { ROW_MAJOR, COLUMN_MAJOR };
+
+// Aggregate functions for csv_group_by()
+enum aggregates { AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG, AGG_VAR };
+
 // Metadata field for the table header
 typedef struct {
 	char *name;
 	enum types type;
+	enum widths width; // Narrowest storage of a number field
 } csv_field;
 
 // Single record in linked list table structure
 struct _csv_record {
 	void **record;
+	int row;                  // Position of the record in the table
 	struct _csv_record *next;
 };
 
 typedef struct _csv_record csv_record;
 
+// Secondary index on a field: sorted for number fields, hashed
+// for string fields
+struct _csv_index {
+	int field;                // Index of the indexed field
+	enum types type;          // Type of the indexed field
+	bool hashed;              // True for a hash index
+	int count;                // # of records in the index
+	int capacity;             // Allocated size of records
+	csv_record **records;     // Sorted index: records sorted by field value, then row
+	                          // Hash index: open-addressing slots, NULL if empty
+	uint64_t *hashes;         // Hash index: hash of the value in each slot
+	struct _csv_index *next;  // Next index on the same table
+};
+
+typedef struct _csv_index csv_index;
+
+// Number of consecutive records summarized by each zone
+#define ZONE_SIZE 4096
+
+// Bound on the values of a field, of the same type as its cells
+typedef union {
+	dfloat64_t number;
+	int64_t integer;
+	double real;
+} csv_bound;
+
+// Statistics on a block of ZONE_SIZE consecutive records, used to
+// skip blocks that cannot satisfy a condition; the statistics may
+// be wider than the values actually in the block, but never narrower
+typedef struct {
+	csv_record *first; // First record in the block
+	int count;         // # of records in the block
+	csv_bound *min;    // Smallest value of each number, int64 or double field
+	csv_bound *max;    // Largest value of each number, int64 or double field
+	uint8_t **bloom;   // Bloom filter of the values of each string field
+} csv_zone;
+
 // Handle for abstract table structure
 typedef struct {
 	int rlen;           // # of fields in each record
 	csv_field **header; // Table metadata
 	csv_record *start;  // Pointer to first record
 	csv_record *cur;    // Pointer to current record
+	csv_index *indexes; // Secondary indexes kept up to date by the table functions
+	csv_zone *zones;    // Zone map, one zone for each ZONE_SIZE records
+	int zcount;         // # of zones
+	bool view;          // True if the cells belong to other tables
+	bool own_names;     // True if the field names belong to this table
+	bool *fixed;        // True for each fixed-point number field, NULL if none is
+	int32_t *scales;    // Exponent at which the cells of each fixed-point field are compared
 } csv_table;
 
 // Data type used by csv_set.c
@@ -49,6 +118,96 @@ typedef struct {
 	uint8_t *bits;	// Each bit corresponds to a member of the universe
 } csv_set;
 
+// Condition for csv_select_subset() with its field resolved and
+// its operand parsed, so that it can be evaluated repeatedly
+typedef struct {
+	enum operators operator;
+	int field;         // Index of the field being compared
+	dfloat64_t number; // Operand of a numerical comparison
+	char *string;      // Operand of a string comparison
+	int modulus;       // Base of the MOD operator
+	int residue;       // Residue class of the MOD operator
+	enum types type;   // Type of the field being compared
+	int64_t integer;   // Operand of a comparison on an int64 field
+	bool whole;        // False if that operand had to be rounded
+	double real;       // Operand of a comparison on a double field
+} csv_predicate;
+
+// Mergeable quantile sketch created by csv_create_sketch()
+typedef struct _csv_sketch csv_sketch;
+
+// Histogram with nbins bins of equal width between lo and hi,
+// created by csv_create_histogram()
+typedef struct {
+	double lo;
+	double hi;
+	int nbins;
+	int64_t *bins;  // # of values in each bin
+	int64_t below;  // # of values below lo
+	int64_t above;  // # of values at or above hi
+} csv_histogram;
+
+// Distinct counter created by csv_create_hll()
+typedef struct _csv_hll csv_hll;
+
+// Options of csv_open_reader_with(); csv_reader_defaults() sets each
+// one to the value used by csv_open_reader()
+typedef struct {
+	int sample_rows;     // # of lines examined to infer the types of the fields
+	bool sample_spread;  // True to take those lines at even intervals throughout the file
+	bool native_numbers; // True to read number fields as csv_int64 and csv_double fields
+} csv_reader_options;
+
+// Streaming reader returned by csv_open_reader(), for files that
+// are read one record at a time instead of as a whole table
+typedef struct {
+	FILE *fp;
+	csv_reader_options options; // Options the reader was opened with
+	int rlen;                // # of fields in each record
+	csv_field **header;      // Names and types of the fields
+	char *buf;               // Line buffer
+	int size;
+	int row;                 // Row number of the next record
+	int flen;                // # of fields in each line of the file
+	csv_field **fields;      // Every field of the file
+	int *columns;            // Position in a record of each field of the file,
+	                         // -1 if it is skipped, or NULL to keep every field
+	char **cells;            // Start of each field in the line buffer
+	csv_predicate **filters; // Conditions that records must satisfy
+	int nfilters;
+	int line;                // # of lines read, including discarded ones
+	int nsketches;           // Summaries fed with every record read
+	int *sketch_fields;      // Field of the file each summary is fed with
+	csv_sketch **sketches;   // Either a sketch or a histogram may be NULL
+	csv_histogram **histograms;
+	int ncounters;           // Distinct counters fed with every record read
+	int *counter_fields;     // Field of the file each counter is fed with
+	csv_hll **counters;
+} csv_reader;
+
+// Selection expression compiled by csv_compile_expr()
+typedef struct _csv_expr csv_expr;
+
+// Lazy query built by the csv_query_*() functions and run by
+// csv_query_execute()
+typedef struct _csv_query csv_query;
+
+// Aggregate column computed by csv_group_by()
+typedef struct {
+	enum aggregates function;
+	char *field; // Number field to aggregate, unused by AGG_COUNT
+} csv_aggregate;
+
+// Statistics of a field computed by csv_column_stats()
+typedef struct {
+	int count;       // # of values included in the statistics
+	int invalid;     // # of NaN and infinite values, which are left out
+	double min;
+	double max;
+	double mean;
+	double variance; // Sample variance, 0 for fewer than two values
+} csv_stats;
+
 typedef struct {
 	csv_table *ident; // Records that match the condition
 	csv_table *cplmt; // Records that don't match the condition
@@ -76,19 +235,45 @@ typedef struct {
 #define csv_snfbi csv_set_number_field_by_index
 #define csv_ssfbn csv_set_string_field_by_name
 #define csv_ssfbi csv_set_string_field_by_index
+#define csv_gifbn csv_get_int64_field_by_name
+#define csv_gifbi csv_get_int64_field_by_index
+#define csv_gdfbn csv_get_double_field_by_name
+#define csv_gdfbi csv_get_double_field_by_index
+#define csv_sifbn csv_set_int64_field_by_name
+#define csv_sifbi csv_set_int64_field_by_index
+#define csv_sdfbn csv_set_double_field_by_name
+#define csv_sdfbi csv_set_double_field_by_index
 
 #define csv_select_records csv_select_records_by_subset
 
 __BEGIN_DECLS
 bool csv_validate_file( FILE *, bool );
 csv_table *csv_read_table( FILE *, bool );
+csv_table *csv_read_table_columns( FILE *, bool, char **, int );
+csv_table *csv_read_table_where( FILE *, bool, enum operators, char *, char * );
 void csv_write_table( FILE *, csv_table *, bool );
+csv_table *csv_read_table_with( FILE *, bool, csv_reader_options * );
+void csv_reader_defaults( csv_reader_options * );
+csv_reader *csv_open_reader( FILE *, bool );
+csv_reader *csv_open_reader_with( FILE *, bool, csv_reader_options * );
+bool csv_reader_select( csv_reader *, int, char ** );
+bool csv_reader_where( csv_reader *, enum operators, char *, char * );
+bool csv_reader_sketch( csv_reader *, char *, csv_sketch *, csv_histogram * );
+bool csv_reader_distinct( csv_reader *, char *, csv_hll * );
+csv_record *csv_read_record( csv_reader * );
+void csv_free_record( csv_reader *, csv_record * );
+void csv_close_reader( csv_reader * );
+csv_table *csv_read_records( csv_reader * );
+void csv_write_header( FILE *, int, csv_field ** );
+bool csv_write_record( FILE *, int, csv_field **, void ** );
 csv_table *csv_create_table( int, csv_field ** );
 void csv_drop_table( csv_table * );
+bool csv_fix_column( csv_table *, char * );
 csv_table *csv_alter_table_add( csv_table *, csv_field * );
 csv_table *csv_alter_table_drop( csv_table *, char * );
 csv_record *csv_next_record( csv_table * );
 void csv_rewind( csv_table * );
+int csv_count_records( csv_table * );
 void csv_insert_record( csv_table *, void ** );
 void csv_insert_new_record( csv_table * );
 void csv_delete_current_record( csv_table * );
@@ -100,6 +285,14 @@ void csv_set_number_field_by_name( csv_table *, char *, dfloat64_t * );
 void csv_set_number_field_by_index( csv_table *, int, dfloat64_t * );
 void csv_set_string_field_by_name( csv_table *, char *, char * );
 void csv_set_string_field_by_index( csv_table *, int, char * );
+int64_t *csv_get_int64_field_by_name( csv_table *, char * );
+int64_t *csv_get_int64_field_by_index( csv_table *, int );
+double *csv_get_double_field_by_name( csv_table *, char * );
+double *csv_get_double_field_by_index( csv_table *, int );
+void csv_set_int64_field_by_name( csv_table *, char *, int64_t );
+void csv_set_int64_field_by_index( csv_table *, int, int64_t );
+void csv_set_double_field_by_name( csv_table *, char *, double );
+void csv_set_double_field_by_index( csv_table *, int, double );
 csv_set *csv_empty_set( int );
 csv_set *csv_set_universe( int );
 void csv_set_add( csv_set *, int );
@@ -116,19 +309,74 @@ csv_set *csv_set_intersection_f( csv_set *, csv_set * );
 csv_set *csv_read_set( char * );
 char *csv_write_set( csv_set * );
 char *csv_write_set_f( csv_set * );
+bool csv_write_set_binary( FILE *, csv_set *, bool );
+csv_set *csv_read_set_binary( FILE * );
+csv_set *csv_map_set( char * );
+void csv_unmap_set( csv_set * );
 csv_set *csv_select_subset( csv_table *, enum operators, char *, char * );
+csv_predicate *csv_prepare_predicate( csv_table *, enum operators, char *, char * );
+csv_set *csv_select_subset_by_predicate( csv_table *, csv_predicate * );
+void csv_free_predicate( csv_predicate * );
 csv_table *csv_select_records_by_subset( csv_table *, csv_set * );
 csv_table *csv_select_records_by_expr( csv_table *, char * );
 csv_partition *csv_partition_table_by_subset( csv_table *, csv_set * );
-csv_partition *csv_partition_table_by_expr( csv_table *, csv_set * );
+csv_partition *csv_partition_table_by_expr( csv_table *, char * );
+csv_table **csv_partition_table_by_hash( csv_table *, char *, int );
+csv_table **csv_partition_table_by_range( csv_table *, char *, int, char ** );
+csv_expr *csv_compile_expr( csv_table *, char * );
+csv_set *csv_select_subset_by_expr( csv_table *, csv_expr * );
+void csv_free_expr( csv_expr * );
+csv_index *csv_create_index( csv_table *, char * );
+void csv_drop_index( csv_table *, char * );
+csv_record *csv_find_record( csv_table *, char *, char * );
+void csv_analyze_table( csv_table * );
+bool csv_sort_table( csv_table *, int, char **, enum directions * );
+csv_set *csv_top_k( csv_table *, char *, int, enum directions );
+csv_table *csv_group_by( csv_table *, int, char **, int, csv_aggregate * );
+csv_table *csv_group_by_subset( csv_table *, csv_set *, int, char **, int, csv_aggregate * );
+csv_table *csv_join( csv_table *, csv_table *, char *, char *, enum joins );
+csv_set *csv_distinct( csv_table *, int, char ** );
+csv_set *csv_distinct_sorted( csv_table *, int, char ** );
+bool csv_external_sort( FILE *, bool, FILE *, int, char **, enum directions *, size_t );
+bool csv_merge_join( FILE *, FILE *, bool, char *, char *, enum joins, FILE *, size_t );
+csv_query *csv_query_from( csv_table * );
+void csv_query_where_subset( csv_query *, csv_set * );
+void csv_query_where_predicate( csv_query *, csv_predicate * );
+void csv_query_where_expr( csv_query *, csv_expr * );
+void csv_query_select( csv_query *, int, char ** );
+void csv_query_order_by( csv_query *, int, char **, enum directions * );
+void csv_query_group_by( csv_query *, int, char **, int, csv_aggregate * );
+csv_table *csv_query_execute( csv_query * );
+void csv_free_query( csv_query * );
+bool csv_to_matrix( csv_table *, int, char **, enum layouts, double * );
+bool csv_to_matrix_float( csv_table *, int, char **, enum layouts, float * );
+csv_stats *csv_column_stats( csv_table *, char * );
+csv_stats *csv_multi_column_stats( csv_table *, int, char ** );
+csv_sketch *csv_create_sketch( int );
+void csv_sketch_add( csv_sketch *, double );
+void csv_sketch_merge( csv_sketch *, csv_sketch * );
+double csv_sketch_quantile( csv_sketch *, double );
+int64_t csv_sketch_count( csv_sketch * );
+void csv_free_sketch( csv_sketch * );
+csv_histogram *csv_create_histogram( double, double, int );
+void csv_histogram_add( csv_histogram *, double );
+bool csv_histogram_merge( csv_histogram *, csv_histogram * );
+void csv_free_histogram( csv_histogram * );
+bool csv_column_sketch( csv_table *, char *, csv_sketch *, csv_histogram * );
+csv_hll *csv_create_hll( void );
+void csv_hll_add( csv_hll *, const void *, size_t );
+void csv_hll_add_cell( csv_hll *, csv_table *, int, void * );
+void csv_hll_merge( csv_hll *, csv_hll * );
+int64_t csv_hll_count( csv_hll * );
+void csv_free_hll( csv_hll * );
+int64_t csv_approx_distinct( csv_table *, char * );
+void csv_set_threads( int );
 __END_DECLS
 
 /*
  * Note: The following functions are not yet implemented:
  * csv_alter_table_add()
  * csv_alter_table_drop()
- * csv_select_records_by_expr()
- * csv_partition_table_by_expr()
  */
 
 #endif
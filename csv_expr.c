@@ -0,0 +1,865 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Compiler and interpreter   *
+ *                 for selection expressions  *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "expr.h"
+#include "kernels.h"
+#include "zone.h"
+
+/*
+ * Expressions are compiled into a postfix program for a stack
+ * machine whose stack slots hold one value for each record in
+ * a batch of EXPR_BATCH records, so that every instruction is
+ * executed once per batch rather than once per record.
+ *
+ * Grammar, from lowest to highest precedence:
+ *
+ * or      := and { "||" and }
+ * and     := not { "&&" not }
+ * not     := "!" not | compare
+ * compare := sum [ ("==" | "=" | "!=" | "<>" | "<" | ">" | "<=" | ">=") sum ]
+ * sum     := term { ("+" | "-") term }
+ * term    := unary { ("*" | "/" | "%") unary }
+ * unary   := "-" unary | primary
+ * primary := number | "string" | field | `field name` | "(" or ")"
+ *
+ * Fields are resolved to their indices at compile time. Field
+ * names that are not valid identifiers can be written between
+ * backquotes. Fields of int64 and double type are evaluated as
+ * doubles, and so is any number they are combined with; their
+ * comparisons with a constant are exact.
+ */
+
+// Precision passed to dfloat64_div() by the division operator
+#define EXPR_DIV_PRECISION 6
+
+// Parser state
+typedef struct {
+	char *src;                // Current position in the source
+	csv_table *table;         // Table providing the field names
+	csv_expr *expr;           // Program being generated
+	enum value_types *types;  // Types of the values on the stack
+	int sp;                   // # of values on the stack
+	int cap;                  // Allocated size of expr->code
+	bool error;
+} expr_parser;
+
+static void parse_or( expr_parser * );
+
+// Skips whitespace and checks whether the source continues with
+// the given token, consuming it if it does
+static bool accept( expr_parser *p, char *token ){
+	int len;
+	while( isspace( (unsigned char) *p->src ) )
+		p->src++;
+	len = strlen( token );
+	if( strncmp( p->src, token, len ) )
+		return false;
+	p->src += len;
+	return true;
+}
+
+// Appends an instruction to the program and updates the type stack,
+// pops is the number of operands consumed by the instruction
+static void emit( expr_parser *p, enum opcodes opcode, enum value_types type, int pops, enum value_types result, int arg ){
+	expr_instr *ins;
+	if( p->error )
+		return;
+	if( p->expr->ncode == p->cap ){
+		p->cap <<= 1;
+		p->expr->code = (expr_instr *) realloc( p->expr->code, p->cap * sizeof( expr_instr ) );
+	}
+	ins = p->expr->code + p->expr->ncode++;
+	ins->opcode = opcode;
+	ins->type = type;
+	ins->rel = EQ;
+	ins->arg = arg;
+	ins->k = 0;
+	ins->cell = csv_number;
+	p->sp -= pops;
+	p->types[p->sp++] = result;
+	if( p->sp > p->expr->depth )
+		p->expr->depth = p->sp;
+}
+
+// Checks that the top n values on the stack have the given type
+static bool check_types( expr_parser *p, int n, enum value_types type ){
+	int i;
+	if( p->error || p->sp < n )
+		return false;
+	for( i = 1; i <= n; i++ ){
+		if( p->types[p->sp-i] != type ){
+			p->error = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Parses a number, string or field operand
+static void parse_primary( expr_parser *p ){
+	csv_expr *e;
+	dfloat64_t *df;
+	char *start;
+	char *name;
+	int len, f;
+	char quote;
+	e = p->expr;
+	if( p->error )
+		return;
+	if( accept( p, "(" ) ){
+		parse_or( p );
+		if( !accept( p, ")" ) )
+			p->error = true;
+		return;
+	}
+	start = p->src;
+	if( isdigit( (unsigned char) *start ) ){
+		// Numeric constant
+		while( isdigit( (unsigned char) *p->src ) )
+			p->src++;
+		if( *p->src == '.' && isdigit( (unsigned char) p->src[1] ) ){
+			p->src++;
+			while( isdigit( (unsigned char) *p->src ) )
+				p->src++;
+		}
+		len = p->src - start;
+		name = (char *) malloc( len + 1 );
+		strncpy( name, start, len );
+		name[len] = '\0';
+		df = dfloat64_atof( name );
+		free( name );
+		e->numbers = (dfloat64_t *) realloc( e->numbers, (e->nnumbers + 1) * sizeof( dfloat64_t ) );
+		memcpy( e->numbers + e->nnumbers, df, sizeof( dfloat64_t ) );
+		free( df );
+		emit( p, OP_NUMBER, V_NUMBER, 0, V_NUMBER, e->nnumbers++ );
+		return;
+	}
+	if( *start == '"' || *start == '`' ){
+		// String constant or quoted field name
+		quote = *start;
+		p->src++;
+		while( *p->src && *p->src != quote )
+			p->src++;
+		if( !*p->src ){
+			p->error = true;
+			return;
+		}
+		len = p->src - start - 1;
+		p->src++;
+		name = (char *) malloc( len + 1 );
+		strncpy( name, start + 1, len );
+		name[len] = '\0';
+		if( quote == '"' ){
+			e->strings = (char **) realloc( e->strings, (e->nstrings + 1) * sizeof( char * ) );
+			e->strings[e->nstrings] = name;
+			emit( p, OP_STRING, V_STRING, 0, V_STRING, e->nstrings++ );
+			return;
+		}
+	}
+	else if( isalpha( (unsigned char) *start ) || *start == '_' ){
+		// Field name
+		while( isalnum( (unsigned char) *p->src ) || *p->src == '_' || *p->src == '.' )
+			p->src++;
+		len = p->src - start;
+		name = (char *) malloc( len + 1 );
+		strncpy( name, start, len );
+		name[len] = '\0';
+	}
+	else{
+		p->error = true;
+		return;
+	}
+	for( f = 0; f < p->table->rlen; f++ ){
+		if( !strcmp( p->table->header[f]->name, name ) )
+			break;
+	}
+	free( name );
+	if( f == p->table->rlen ){
+	// Error: Name not found
+		p->error = true;
+		return;
+	}
+	if( p->table->header[f]->type == csv_number )
+		emit( p, OP_FIELD, V_NUMBER, 0, V_NUMBER, f );
+	else if( p->table->header[f]->type == csv_string )
+		emit( p, OP_FIELD, V_STRING, 0, V_STRING, f );
+	else{
+		emit( p, OP_FIELD, V_REAL, 0, V_REAL, f );
+		if( !p->error )
+			e->code[e->ncode-1].cell = p->table->header[f]->type;
+	}
+}
+
+// Checks that the top two values on the stack are numbers or reals,
+// converting a number to a real if the other one is a real; returns
+// the type of the result of an arithmetic operator on them
+static enum value_types check_numeric( expr_parser *p ){
+	enum value_types a, b;
+	if( p->error || p->sp < 2 )
+		return V_TRUTH;
+	a = p->types[p->sp-2];
+	b = p->types[p->sp-1];
+	if( (a != V_NUMBER && a != V_REAL) || (b != V_NUMBER && b != V_REAL) ){
+	// Error: Type mismatch
+		p->error = true;
+		return V_TRUTH;
+	}
+	if( a == b )
+		return a;
+	// The converted value keeps its place on the stack
+	emit( p, OP_TOREAL, V_NUMBER, 1, V_REAL, a == V_NUMBER );
+	if( a == V_NUMBER ){
+		p->types[p->sp-1] = V_REAL;
+		p->types[p->sp-2] = V_REAL;
+	}
+	return V_REAL;
+}
+
+// Parses unary minus
+static void parse_unary( expr_parser *p ){
+	csv_expr *e;
+	e = p->expr;
+	if( accept( p, "-" ) ){
+		parse_unary( p );
+		if( p->error || (p->types[p->sp-1] != V_NUMBER && p->types[p->sp-1] != V_REAL) ){
+			p->error = true;
+			return;
+		}
+		// Fold negative constants so that they can still be
+		// fused into comparisons
+		if( e->code[e->ncode-1].opcode == OP_NUMBER )
+			e->numbers[e->code[e->ncode-1].arg].mantissa *= -1;
+		else
+			emit( p, OP_NEG, p->types[p->sp-1], 1, p->types[p->sp-1], 0 );
+		return;
+	}
+	parse_primary( p );
+}
+
+// Parses multiplication, division and modulus
+static void parse_term( expr_parser *p ){
+	enum value_types type;
+	enum opcodes op;
+	parse_unary( p );
+	while( !p->error ){
+		if( accept( p, "*" ) ) op = OP_MUL;
+		else if( accept( p, "/" ) ) op = OP_DIV;
+		else if( accept( p, "%" ) ) op = OP_MOD;
+		else return;
+		parse_unary( p );
+		type = check_numeric( p );
+		emit( p, op, type, 2, type, 0 );
+	}
+}
+
+// Parses addition and subtraction
+static void parse_sum( expr_parser *p ){
+	enum value_types type;
+	enum opcodes op;
+	parse_term( p );
+	while( !p->error ){
+		if( accept( p, "+" ) ) op = OP_ADD;
+		else if( accept( p, "-" ) ) op = OP_SUB;
+		else return;
+		parse_term( p );
+		type = check_numeric( p );
+		emit( p, op, type, 2, type, 0 );
+	}
+}
+
+// Fuses a comparison between an int64 or double field and a numeric
+// constant into an OP_CMPK instruction on a predicate, which is
+// evaluated exactly on the cells of the field; returns false if the
+// operands are anything else
+static bool fuse_native( expr_parser *p, enum operators rel ){
+	static const enum operators flipped[] = { [EQ] = EQ, [NE] = NE, [LT] = GT, [GT] = LT, [LE] = GE, [GE] = LE };
+	csv_predicate *pred;
+	expr_instr *a, *b;
+	csv_expr *e;
+	e = p->expr;
+	a = e->code + e->ncode - 2;
+	b = e->code + e->ncode - 1;
+	if( a->opcode == OP_FIELD && a->type == V_REAL && b->opcode == OP_NUMBER )
+		b->k = b->arg;
+	else if( b->opcode == OP_FIELD && b->type == V_REAL && a->opcode == OP_NUMBER ){
+		b->k = a->arg;
+		*a = *b;
+		rel = flipped[rel];
+	}
+	else
+		return false;
+	e->preds = (csv_predicate *) realloc( e->preds, (e->npreds + 1) * sizeof( csv_predicate ) );
+	pred = e->preds + e->npreds;
+	memset( pred, 0, sizeof( csv_predicate ) );
+	pred->operator = rel;
+	pred->field = a->arg;
+	pred->type = a->cell;
+	if( pred->type == csv_int64 )
+		csv_integer_operand( pred, csv_dfloat_to_double( e->numbers + b->k ) );
+	else
+		pred->real = csv_dfloat_to_double( e->numbers + b->k );
+	a->opcode = OP_CMPK;
+	a->rel = rel;
+	a->k = e->npreds++;
+	e->ncode--;
+	p->sp--;
+	p->types[p->sp-1] = V_TRUTH;
+	return true;
+}
+
+// Parses a comparison, fusing comparisons between a field and a
+// constant into a single OP_CMPK instruction
+static void parse_compare( expr_parser *p ){
+	static const enum operators flipped[] = { [EQ] = EQ, [NE] = NE, [LT] = GT, [GT] = LT, [LE] = GE, [GE] = LE };
+	enum operators rel;
+	enum value_types type;
+	expr_instr *a, *b;
+	csv_expr *e;
+	parse_sum( p );
+	if( p->error )
+		return;
+	if( accept( p, "==" ) || accept( p, "=" ) ) rel = EQ;
+	else if( accept( p, "!=" ) || accept( p, "<>" ) ) rel = NE;
+	else if( accept( p, "<=" ) ) rel = LE;
+	else if( accept( p, ">=" ) ) rel = GE;
+	else if( accept( p, "<" ) ) rel = LT;
+	else if( accept( p, ">" ) ) rel = GT;
+	else return;
+	type = p->types[p->sp-1];
+	parse_sum( p );
+	if( p->error || type == V_TRUTH ){
+		p->error = true;
+		return;
+	}
+	if( type != V_STRING && fuse_native( p, rel ) )
+		return;
+	if( type != V_STRING )
+		type = check_numeric( p );
+	if( !check_types( p, 2, type ) ){
+		p->error = true;
+		return;
+	}
+	e = p->expr;
+	a = e->code + e->ncode - 2;
+	b = e->code + e->ncode - 1;
+	if( a->opcode == OP_FIELD && (b->opcode == OP_NUMBER || b->opcode == OP_STRING) ){
+		a->opcode = OP_CMPK;
+		a->rel = rel;
+		a->k = b->arg;
+	}
+	else if( b->opcode == OP_FIELD && (a->opcode == OP_NUMBER || a->opcode == OP_STRING) ){
+		a->opcode = OP_CMPK;
+		a->rel = flipped[rel];
+		a->k = a->arg;
+		a->arg = b->arg;
+		a->type = b->type;
+	}
+	else{
+		emit( p, OP_CMP, type, 2, V_TRUTH, 0 );
+		e->code[e->ncode-1].rel = rel;
+		return;
+	}
+	e->ncode--;
+	p->sp--;
+	p->types[p->sp-1] = V_TRUTH;
+}
+
+// Parses logical negation
+static void parse_not( expr_parser *p ){
+	if( accept( p, "!=" ) ){
+		p->error = true;
+		return;
+	}
+	if( accept( p, "!" ) ){
+		parse_not( p );
+		if( check_types( p, 1, V_TRUTH ) )
+			emit( p, OP_NOT, V_TRUTH, 1, V_TRUTH, 0 );
+		else
+			p->error = true;
+		return;
+	}
+	parse_compare( p );
+}
+
+// Parses logical conjunction
+static void parse_and( expr_parser *p ){
+	parse_not( p );
+	while( !p->error && accept( p, "&&" ) ){
+		parse_not( p );
+		if( check_types( p, 2, V_TRUTH ) )
+			emit( p, OP_AND, V_TRUTH, 2, V_TRUTH, 0 );
+		else
+			p->error = true;
+	}
+}
+
+// Parses logical disjunction
+static void parse_or( expr_parser *p ){
+	parse_and( p );
+	while( !p->error && accept( p, "||" ) ){
+		parse_and( p );
+		if( check_types( p, 2, V_TRUTH ) )
+			emit( p, OP_OR, V_TRUTH, 2, V_TRUTH, 0 );
+		else
+			p->error = true;
+	}
+}
+
+// Compiles an expression against the header of a table;
+// returns NULL if the expression is malformed, refers to a
+// field that does not exist or mixes incompatible types
+csv_expr *csv_compile_expr( csv_table *table, char *src ){
+	expr_parser p;
+	csv_expr *expr;
+	expr = (csv_expr *) calloc( 1, sizeof( csv_expr ) );
+	expr->rlen = table->rlen;
+	p.src = src;
+	p.table = table;
+	p.expr = expr;
+	p.types = (enum value_types *) malloc( (strlen( src ) + 1) * sizeof( enum value_types ) );
+	p.sp = 0;
+	p.cap = 16;
+	p.error = false;
+	expr->code = (expr_instr *) malloc( p.cap * sizeof( expr_instr ) );
+	parse_or( &p );
+	while( isspace( (unsigned char) *p.src ) )
+		p.src++;
+	if( *p.src || p.sp != 1 || p.types[0] != V_TRUTH )
+		p.error = true;
+	free( p.types );
+	if( p.error ){
+		csv_free_expr( expr );
+		return NULL;
+	}
+	return expr;
+}
+
+// Frees an expression returned by csv_compile_expr()
+void csv_free_expr( csv_expr *expr ){
+	int i;
+	for( i = 0; i < expr->nstrings; i++ )
+		free( expr->strings[i] );
+	free( expr->strings );
+	free( expr->numbers );
+	free( expr->preds );
+	free( expr->code );
+	free( expr );
+}
+
+// Allocates an interpreter stack large enough for an expression;
+// each concurrent evaluation needs its own stack
+expr_slot *csv_expr_alloc_stack( csv_expr *expr ){
+	return (expr_slot *) malloc( expr->depth * sizeof( expr_slot ) );
+}
+
+// Remainder of a division of two decimal numbers with the sign of
+// the dividend, computed on the mantissas at the smaller exponent
+static void dfloat64_mod( dfloat64_t *dst, dfloat64_t *src ){
+	int64_t a, b;
+	int e;
+	a = dst->mantissa;
+	b = src->mantissa;
+	if( b == 0 ){
+	// Division by zero
+		dst->mantissa = 0;
+		dst->exponent = 0;
+		return;
+	}
+	if( src->exponent > dst->exponent ){
+		// |dst| < 10^10 * 10^dst->exponent <= |src| past nine digits,
+		// so dst is its own remainder
+		if( src->exponent - dst->exponent > 9 )
+			return;
+		for( e = src->exponent; e > dst->exponent; e-- )
+			b *= 10;
+		dst->mantissa = (int32_t) (a % b);
+		return;
+	}
+	// Bring dst down to the exponent of src one digit at a time,
+	// reducing after each digit so that nothing overflows
+	a %= b;
+	for( e = dst->exponent; e > src->exponent; e-- )
+		a = a * 10 % b;
+	dst->mantissa = (int32_t) a;
+	dst->exponent = src->exponent;
+}
+
+// Returns -1, 0 or 1 according to the sign of a strcmp() result
+#define sign( c ) (((c) > 0) - ((c) < 0))
+
+// Runs an expression over a batch of n records, storing one truth
+// value per record in out; n must not exceed EXPR_BATCH
+void csv_expr_eval_batch( csv_expr *expr, expr_slot *stack, void ***recs, int n, uint8_t *out ){
+	dfloat64_t *cells[EXPR_BATCH];
+	int64_t values[EXPR_BATCH];
+	double reals[EXPR_BATCH];
+	int64_t kv;
+	expr_instr *ins;
+	expr_slot *top;
+	expr_slot *slot;
+	dfloat64_t *k;
+	double u, v;
+	char *ks;
+	int pc, i, f, mask;
+	top = stack - 1;
+	for( pc = 0; pc < expr->ncode; pc++ ){
+		ins = expr->code + pc;
+		f = ins->arg;
+		switch( ins->opcode ){
+			case OP_FIELD :
+				top++;
+				if( ins->type == V_NUMBER ){
+					for( i = 0; i < n; i++ )
+						memcpy( top->number + i, recs[i][f], sizeof( dfloat64_t ) );
+				}
+				else if( ins->cell == csv_int64 ){
+					for( i = 0; i < n; i++ )
+						top->real[i] = (double) *(int64_t *) recs[i][f];
+				}
+				else if( ins->cell == csv_double ){
+					for( i = 0; i < n; i++ )
+						top->real[i] = *(double *) recs[i][f];
+				}
+				else{
+					for( i = 0; i < n; i++ )
+						top->string[i] = (char *) recs[i][f];
+				}
+				break;
+			case OP_NUMBER :
+				top++;
+				for( i = 0; i < n; i++ )
+					top->number[i] = expr->numbers[f];
+				break;
+			case OP_STRING :
+				top++;
+				for( i = 0; i < n; i++ )
+					top->string[i] = expr->strings[f];
+				break;
+			case OP_TOREAL :
+				slot = top - f;
+				for( i = 0; i < n; i++ )
+					slot->real[i] = csv_dfloat_to_double( slot->number + i );
+				break;
+			case OP_NEG :
+				if( ins->type == V_REAL ){
+					for( i = 0; i < n; i++ )
+						top->real[i] = -top->real[i];
+					break;
+				}
+				for( i = 0; i < n; i++ )
+					top->number[i].mantissa = -top->number[i].mantissa;
+				break;
+			case OP_ADD :
+				top--;
+				if( ins->type == V_REAL ){
+					for( i = 0; i < n; i++ )
+						top->real[i] += top[1].real[i];
+					break;
+				}
+				for( i = 0; i < n; i++ )
+					dfloat64_add( top->number + i, top[1].number + i );
+				break;
+			case OP_SUB :
+				top--;
+				if( ins->type == V_REAL ){
+					for( i = 0; i < n; i++ )
+						top->real[i] -= top[1].real[i];
+					break;
+				}
+				for( i = 0; i < n; i++ )
+					dfloat64_sub( top->number + i, top[1].number + i );
+				break;
+			case OP_MUL :
+				top--;
+				if( ins->type == V_REAL ){
+					for( i = 0; i < n; i++ )
+						top->real[i] *= top[1].real[i];
+					break;
+				}
+				for( i = 0; i < n; i++ )
+					dfloat64_mul( top->number + i, top[1].number + i );
+				break;
+			case OP_DIV :
+				top--;
+				if( ins->type == V_REAL ){
+					// Division by zero gives zero, as it does for numbers
+					for( i = 0; i < n; i++ )
+						top->real[i] = top[1].real[i] != 0 ? top->real[i] / top[1].real[i] : 0;
+					break;
+				}
+				for( i = 0; i < n; i++ ){
+					if( top[1].number[i].mantissa )
+						dfloat64_div( top->number + i, top[1].number + i, EXPR_DIV_PRECISION );
+					else
+						top->number[i].mantissa = top->number[i].exponent = 0;
+				}
+				break;
+			case OP_MOD :
+				top--;
+				if( ins->type == V_REAL ){
+					for( i = 0; i < n; i++ )
+						top->real[i] = top[1].real[i] != 0 ? fmod( top->real[i], top[1].real[i] ) : 0;
+					break;
+				}
+				for( i = 0; i < n; i++ )
+					dfloat64_mod( top->number + i, top[1].number + i );
+				break;
+			// Comparisons overwrite their left operand with truth
+			// values; truth[i] only overlaps operands that have
+			// already been read, so this is safe going forwards
+			case OP_CMP :
+				top--;
+				mask = csv_cmp_masks[ins->rel];
+				if( ins->type == V_NUMBER ){
+					for( i = 0; i < n; i++ )
+						top->truth[i] = (mask >> (dfloat64_cmp( top->number + i, top[1].number + i ) + 1)) & 1;
+				}
+				else if( ins->type == V_REAL ){
+					// NaN compares false with everything but NE
+					for( i = 0; i < n; i++ ){
+						u = top->real[i];
+						v = top[1].real[i];
+						top->truth[i] = u != u || v != v ? ins->rel == NE : (mask >> ((u > v) - (u < v) + 1)) & 1;
+					}
+				}
+				else{
+					for( i = 0; i < n; i++ )
+						top->truth[i] = (mask >> (sign( strcmp( top->string[i], top[1].string[i] ) ) + 1)) & 1;
+				}
+				break;
+			case OP_CMPK :
+				top++;
+				mask = csv_cmp_masks[ins->rel];
+				if( ins->type == V_NUMBER ){
+					// Numbers go through the block comparison kernels
+					k = expr->numbers + ins->k;
+					for( i = 0; i < n; i++ )
+						cells[i] = (dfloat64_t *) recs[i][f];
+					if( csv_normalize_block( cells, n, k, values, &kv ) )
+						csv_compare_block( values, n, kv, ins->rel, top->truth );
+					else
+						csv_compare_block_slow( cells, n, k, ins->rel, top->truth );
+				}
+				else if( ins->type == V_REAL ){
+					// Native cells are compared exactly by their predicate
+					if( ins->cell == csv_int64 ){
+						for( i = 0; i < n; i++ )
+							values[i] = *(int64_t *) recs[i][f];
+						csv_compare_natives( expr->preds + ins->k, values, n, top->truth );
+					}
+					else{
+						for( i = 0; i < n; i++ )
+							reals[i] = *(double *) recs[i][f];
+						csv_compare_natives( expr->preds + ins->k, reals, n, top->truth );
+					}
+				}
+				else{
+					ks = expr->strings[ins->k];
+					for( i = 0; i < n; i++ )
+						top->truth[i] = (mask >> (sign( strcmp( (char *) recs[i][f], ks ) ) + 1)) & 1;
+				}
+				break;
+			case OP_AND :
+				top--;
+				for( i = 0; i < n; i++ )
+					top->truth[i] &= top[1].truth[i];
+				break;
+			case OP_OR :
+				top--;
+				for( i = 0; i < n; i++ )
+					top->truth[i] |= top[1].truth[i];
+				break;
+			case OP_NOT :
+				for( i = 0; i < n; i++ )
+					top->truth[i] ^= 1;
+				break;
+		}
+	}
+	memcpy( out, stack->truth, n );
+}
+
+// Runs the program of an expression over the statistics of a zone
+// instead of its records, using ZONE_NEVER < ZONE_MAYBE < ZONE_ALWAYS
+// as three-valued truth values, so that && is the minimum, || the
+// maximum and ! the reflection of its operands; every value other
+// than a comparison of a field to a constant is unknown
+static enum zone_results test_zone( csv_table *table, csv_expr *expr, csv_zone *zone, enum zone_results *stack ){
+	expr_instr *ins;
+	enum zone_results *top;
+	csv_predicate pred;
+	top = stack - 1;
+	for( ins = expr->code; ins < expr->code + expr->ncode; ins++ ){
+		switch( ins->opcode ){
+			case OP_FIELD :
+			case OP_NUMBER :
+			case OP_STRING :
+				*++top = ZONE_MAYBE;
+				break;
+			case OP_TOREAL :
+			case OP_NEG :
+				break;
+			case OP_ADD :
+			case OP_SUB :
+			case OP_MUL :
+			case OP_DIV :
+			case OP_MOD :
+			case OP_CMP :
+				*--top = ZONE_MAYBE;
+				break;
+			case OP_CMPK :
+				if( ins->type == V_REAL ){
+					*++top = csv_zone_test( table, zone, expr->preds + ins->k );
+					break;
+				}
+				memset( &pred, 0, sizeof( csv_predicate ) );
+				pred.field = ins->arg;
+				if( ins->type == V_NUMBER ){
+					pred.operator = ins->rel;
+					pred.number = expr->numbers[ins->k];
+				}
+				else{
+					pred.operator = ins->rel == EQ ? SEQ : ins->rel == NE ? SNE : ins->rel;
+					pred.string = expr->strings[ins->k];
+				}
+				*++top = csv_zone_test( table, zone, &pred );
+				break;
+			case OP_AND :
+				top--;
+				if( top[1] < *top )
+					*top = top[1];
+				break;
+			case OP_OR :
+				top--;
+				if( top[1] > *top )
+					*top = top[1];
+				break;
+			case OP_NOT :
+				*top = ZONE_ALWAYS - *top;
+				break;
+		}
+	}
+	return *stack;
+}
+
+// Evaluates an expression on n consecutive records starting with
+// rec and stores the results in bits
+static void eval_range( csv_expr *expr, expr_slot *stack, csv_record *rec, int n, uint8_t *bits ){
+	void **recs[EXPR_BATCH];
+	uint8_t truth[EXPR_BATCH];
+	int i, m;
+	for( i = 0; i < n; i += m ){
+		// Gather the next batch of records
+		for( m = 0; m < EXPR_BATCH && i + m < n; rec = rec->next )
+			recs[m++] = rec->record;
+		csv_expr_eval_batch( expr, stack, recs, m, truth );
+		csv_pack_bits( truth, m, bits + (i >> 3) );
+	}
+}
+
+// Expression evaluation spread over the zones of a table
+typedef struct {
+	csv_table *table;
+	csv_expr *expr;
+	csv_set *subset;
+} expr_job;
+
+// Evaluates an expression on zones lo through hi - 1 with a stack
+// of its own, so that calls on disjoint ranges of zones can run
+// concurrently
+static void eval_zones( void *arg, int lo, int hi ){
+	expr_job *job = (expr_job *) arg;
+	enum zone_results *zstack;
+	expr_slot *stack;
+	csv_zone *zone;
+	uint8_t *bits;
+	int z;
+	stack = csv_expr_alloc_stack( job->expr );
+	zstack = (enum zone_results *) malloc( job->expr->depth * sizeof( enum zone_results ) );
+	// Skip or fill zones whose statistics decide the expression
+	for( z = lo; z < hi; z++ ){
+		zone = job->table->zones + z;
+		bits = job->subset->bits + z * (ZONE_SIZE / 8);
+		switch( test_zone( job->table, job->expr, zone, zstack ) ){
+			case ZONE_NEVER :
+				break;
+			case ZONE_ALWAYS :
+				csv_fill_bits( bits, zone->count );
+				break;
+			case ZONE_MAYBE :
+				eval_range( job->expr, stack, zone->first, zone->count, bits );
+				break;
+		}
+	}
+	free( zstack );
+	free( stack );
+}
+
+// Creates a set type indexing the records in a table that
+// satisfy a compiled expression
+csv_set *csv_select_subset_by_expr( csv_table *table, csv_expr *expr ){
+	expr_slot *stack;
+	csv_set *subset;
+	expr_job job;
+	int rcount;
+	if( !table->zcount ){
+		rcount = csv_count_records( table );
+		subset = csv_empty_set( rcount );
+		stack = csv_expr_alloc_stack( expr );
+		eval_range( expr, stack, table->start->next, rcount, subset->bits );
+		free( stack );
+		return subset;
+	}
+	// Zones are spread across threads when built with _CSV_THREADS
+	job.table = table;
+	job.expr = expr;
+	job.subset = csv_empty_set( csv_zone_rows( table ) );
+	csv_parallel_for( table->zcount, eval_zones, &job );
+	return job.subset;
+}
+
+// Creates a new table consisting of all the records in the
+// given table that satisfy the given expression
+csv_table *csv_select_records_by_expr( csv_table *table, char *src ){
+	csv_expr *expr;
+	csv_set *subset;
+	csv_table *subtab;
+	expr = csv_compile_expr( table, src );
+	if( !expr )
+		return NULL;
+	subset = csv_select_subset_by_expr( table, expr );
+	subtab = csv_select_records_by_subset( table, subset );
+	csv_free_expr( expr );
+	free( subset->bits );
+	free( subset );
+	return subtab;
+}
+
+// Returns a partition of the records that satisfy the given
+// expression and the records that don't
+csv_partition *csv_partition_table_by_expr( csv_table *table, char *src ){
+	csv_expr *expr;
+	csv_set *subset;
+	csv_partition *partition;
+	expr = csv_compile_expr( table, src );
+	if( !expr )
+		return NULL;
+	subset = csv_select_subset_by_expr( table, expr );
+	partition = csv_partition_table_by_subset( table, subset );
+	csv_free_expr( expr );
+	free( subset->bits );
+	free( subset );
+	return partition;
+}
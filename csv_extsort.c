@@ -0,0 +1,427 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: External sorting and       *
+ *                 sort-merge joins           *
+ **********************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+
+/*
+ * Files too large to be read as a table are sorted in two steps.
+ * Records are read in batches that fit in the given amount of
+ * memory; each batch is sorted with csv_sort_table() and written to
+ * a temporary file as a sorted run. The runs are then merged by a
+ * heap that always yields the smallest of their current records.
+ *
+ * Runs are stored in a compact binary format: each number as its
+ * 32-bit mantissa and exponent, each int64 or double as its eight
+ * bytes, and each string as its 32-bit length followed by its
+ * characters. Temporary files are only read back by the process
+ * that wrote them, so native byte order is used.
+ */
+
+// Smallest amount of memory used for each run
+#define MIN_RUN_MEMORY 65536
+
+// Cells of the right file in a left join when no record matches
+static dfloat64_t null_number = { 0, 0 };
+static char null_string[] = "";
+static int64_t null_int64 = 0;
+static double null_double = 0;
+
+// Sorted run in a temporary file and its current record
+typedef struct {
+	FILE *fp;
+	csv_record *cur;
+} run;
+
+// K-way merge of the sorted runs of a file
+typedef struct {
+	int rlen;
+	csv_field **header;
+	int nkeys;
+	int *fields;                 // Key fields
+	enum directions *directions;
+	run *runs;
+	int nruns;
+	int *heap;                   // Runs ordered by current record
+	int hsize;
+} merger;
+
+// Approximate memory used by a record of a table
+static size_t record_size( int rlen, csv_field **header, csv_record *rec ){
+	size_t size;
+	int f;
+	size = sizeof( csv_record ) + rlen * sizeof( void * );
+	for( f = 0; f < rlen; f++ ){
+		if( header[f]->type == csv_string )
+			size += strlen( (char *) rec->record[f] ) + 1 + 2 * sizeof( void * );
+		else if( header[f]->type == csv_number )
+			size += sizeof( dfloat64_t ) + 2 * sizeof( void * );
+		else
+			size += sizeof( int64_t ) + 2 * sizeof( void * );
+	}
+	return size;
+}
+
+// Writes a record to a run
+static void write_row( FILE *fp, int rlen, csv_field **header, csv_record *rec ){
+	dfloat64_t *val;
+	uint32_t len;
+	int f;
+	for( f = 0; f < rlen; f++ ){
+		if( header[f]->type == csv_number ){
+			val = (dfloat64_t *) rec->record[f];
+			fwrite( &val->mantissa, sizeof( val->mantissa ), 1, fp );
+			fwrite( &val->exponent, sizeof( val->exponent ), 1, fp );
+		}
+		else if( header[f]->type != csv_string )
+			fwrite( rec->record[f], sizeof( int64_t ), 1, fp );
+		else{
+			len = (uint32_t) strlen( (char *) rec->record[f] );
+			fwrite( &len, sizeof( len ), 1, fp );
+			fwrite( rec->record[f], 1, len, fp );
+		}
+	}
+}
+
+// Reads the next record of a run; returns NULL at the end of the run
+static csv_record *read_row( FILE *fp, int rlen, csv_field **header ){
+	csv_record *rec;
+	dfloat64_t *val;
+	uint32_t len;
+	int f;
+	rec = (csv_record *) calloc( 1, sizeof( csv_record ) );
+	rec->record = (void **) calloc( rlen, sizeof( void * ) );
+	for( f = 0; f < rlen; f++ ){
+		if( header[f]->type == csv_number ){
+			val = (dfloat64_t *) malloc( sizeof( dfloat64_t ) );
+			rec->record[f] = val;
+			if( fread( &val->mantissa, sizeof( val->mantissa ), 1, fp ) != 1 ||
+			    fread( &val->exponent, sizeof( val->exponent ), 1, fp ) != 1 )
+				break;
+		}
+		else if( header[f]->type != csv_string ){
+			// Int64 and double cells are both eight bytes
+			rec->record[f] = malloc( sizeof( int64_t ) );
+			if( fread( rec->record[f], sizeof( int64_t ), 1, fp ) != 1 )
+				break;
+		}
+		else{
+			if( fread( &len, sizeof( len ), 1, fp ) != 1 )
+				break;
+			rec->record[f] = malloc( len + 1 );
+			if( fread( rec->record[f], 1, len, fp ) != len )
+				break;
+			((char *) rec->record[f])[len] = '\0';
+		}
+	}
+	if( f < rlen ){
+		// End of the run
+		for( f = 0; f < rlen; f++ )
+			free( rec->record[f] );
+		free( rec->record );
+		free( rec );
+		return NULL;
+	}
+	return rec;
+}
+
+// Frees a record read from a run
+static void free_row( int rlen, csv_record *rec ){
+	int f;
+	for( f = 0; f < rlen; f++ )
+		free( rec->record[f] );
+	free( rec->record );
+	free( rec );
+}
+
+// Compares two records by the keys of a merger
+static int compare_records( merger *m, csv_record *a, csv_record *b ){
+	int i, f, c;
+	for( i = 0; i < m->nkeys; i++ ){
+		f = m->fields[i];
+		c = csv_compare_cells( m->header[f]->type, a->record[f], b->record[f] );
+		if( c )
+			return m->directions[i] == DESC ? -c : c;
+	}
+	return 0;
+}
+
+// Returns true if run a must be merged before run b; ties go to the
+// earlier run, which keeps the sort stable
+static bool run_before( merger *m, int a, int b ){
+	int c;
+	c = compare_records( m, m->runs[a].cur, m->runs[b].cur );
+	return c < 0 || (c == 0 && a < b);
+}
+
+// Restores the heap order from position i downwards
+static void sift_down( merger *m, int i ){
+	int child, swap;
+	while( (child = 2 * i + 1) < m->hsize ){
+		if( child + 1 < m->hsize && run_before( m, m->heap[child+1], m->heap[child] ) )
+			child++;
+		if( !run_before( m, m->heap[child], m->heap[i] ) )
+			break;
+		swap = m->heap[i];
+		m->heap[i] = m->heap[child];
+		m->heap[child] = swap;
+		i = child;
+	}
+}
+
+// Reads a file through a reader in batches that fit in memory bytes
+// and writes each batch to a temporary file as a sorted run; returns
+// false if a key does not exist or a temporary file can't be created
+static bool make_runs( csv_reader *reader, int nkeys, char **keys, enum directions *directions, size_t memory, merger *m ){
+	csv_table *batch;
+	csv_record *rec, *tail;
+	size_t used;
+	FILE *fp;
+	int i, f;
+
+	m->rlen = reader->rlen;
+	m->header = reader->header;
+	m->nkeys = nkeys;
+	m->directions = directions;
+	m->fields = (int *) malloc( (nkeys ? nkeys : 1) * sizeof( int ) );
+	m->runs = NULL;
+	m->nruns = 0;
+	m->heap = NULL;
+	m->hsize = 0;
+	for( i = 0; i < nkeys; i++ ){
+		for( f = 0; f < m->rlen; f++ ){
+			if( !strcmp( m->header[f]->name, keys[i] ) )
+				break;
+		}
+		if( f == m->rlen )
+		// Error: Name not found
+			return false;
+		m->fields[i] = f;
+	}
+	if( memory < MIN_RUN_MEMORY )
+		memory = MIN_RUN_MEMORY;
+
+	rec = csv_read_record( reader );
+	while( rec ){
+		// Read as many records as fit in memory
+		batch = csv_create_table( reader->rlen, reader->header );
+		tail = batch->start;
+		used = 0;
+		while( rec && (used < memory || tail == batch->start) ){
+			used += record_size( m->rlen, m->header, rec );
+			tail->next = rec;
+			tail = rec;
+			rec = csv_read_record( reader );
+		}
+		csv_sort_table( batch, nkeys, keys, directions );
+
+		if( !(fp = tmpfile()) ){
+		// Error: Can't create temporary file
+			csv_drop_table( batch );
+			if( rec )
+				csv_free_record( reader, rec );
+			return false;
+		}
+		for( tail = batch->start->next; tail; tail = tail->next )
+			write_row( fp, m->rlen, m->header, tail );
+		rewind( fp );
+		csv_drop_table( batch );
+
+		m->runs = (run *) realloc( m->runs, (m->nruns + 1) * sizeof( run ) );
+		m->runs[m->nruns].fp = fp;
+		m->runs[m->nruns].cur = NULL;
+		m->nruns++;
+	}
+
+	// Start the merge with the first record of each run
+	m->heap = (int *) malloc( (m->nruns ? m->nruns : 1) * sizeof( int ) );
+	for( i = 0; i < m->nruns; i++ ){
+		if( (m->runs[i].cur = read_row( m->runs[i].fp, m->rlen, m->header )) )
+			m->heap[m->hsize++] = i;
+	}
+	for( i = m->hsize / 2 - 1; i >= 0; i-- )
+		sift_down( m, i );
+	return true;
+}
+
+// Returns the next record in sorted order, or NULL once every run
+// is exhausted; the record must be freed with free_row()
+static csv_record *merge_next( merger *m ){
+	csv_record *rec;
+	run *r;
+	if( !m->hsize )
+		return NULL;
+	r = m->runs + m->heap[0];
+	rec = r->cur;
+	if( !(r->cur = read_row( r->fp, m->rlen, m->header )) )
+		m->heap[0] = m->heap[--m->hsize];
+	sift_down( m, 0 );
+	return rec;
+}
+
+// Frees a merger and closes its temporary files
+static void free_merger( merger *m ){
+	int i;
+	for( i = 0; i < m->nruns; i++ ){
+		if( m->runs[i].cur )
+			free_row( m->rlen, m->runs[i].cur );
+		fclose( m->runs[i].fp );
+	}
+	free( m->runs );
+	free( m->heap );
+	free( m->fields );
+}
+
+// Sorts a CSV file that may be too large to be read as a table and
+// writes the result to out as CSV; records are sorted by the nkeys
+// fields named in keys in the given directions, using about memory
+// bytes for each sorted run; returns false if a field does not exist
+// or a temporary file can't be created
+bool csv_external_sort( FILE *in, bool has_header, FILE *out, int nkeys, char **keys, enum directions *directions, size_t memory ){
+	csv_reader *reader;
+	csv_record *rec;
+	merger m;
+	bool ok;
+	reader = csv_open_reader( in, has_header );
+	ok = make_runs( reader, nkeys, keys, directions, memory, &m );
+	if( ok ){
+		if( has_header )
+			csv_write_header( out, m.rlen, m.header );
+		while( (rec = merge_next( &m )) ){
+			csv_write_record( out, m.rlen, m.header, rec->record );
+			free_row( m.rlen, rec );
+		}
+	}
+	free_merger( &m );
+	csv_close_reader( reader );
+	return ok;
+}
+
+// Compares the key of a left record with the key of a right record
+static int compare_keys( merger *l, merger *r, csv_record *a, csv_record *b ){
+	int lf, rf;
+	lf = l->fields[0];
+	rf = r->fields[0];
+	return csv_compare_cells( l->header[lf]->type, a->record[lf], b->record[rf] );
+}
+
+// Writes the combination of a left record and a right record, or
+// the null cells if b is NULL
+static void write_pair( FILE *out, merger *l, merger *r, csv_field **header, void **cells, csv_record *a, csv_record *b ){
+	int f;
+	memcpy( cells, a->record, l->rlen * sizeof( void * ) );
+	for( f = 0; f < r->rlen; f++ ){
+		if( b )
+			cells[l->rlen+f] = b->record[f];
+		else if( r->header[f]->type == csv_number )
+			cells[l->rlen+f] = &null_number;
+		else if( r->header[f]->type == csv_int64 )
+			cells[l->rlen+f] = &null_int64;
+		else if( r->header[f]->type == csv_double )
+			cells[l->rlen+f] = &null_double;
+		else
+			cells[l->rlen+f] = null_string;
+	}
+	csv_write_record( out, l->rlen + r->rlen, header, cells );
+}
+
+// Equivalent to csv_join() on two CSV files that may be too large to
+// be read as tables: sorts both files by their keys with an external
+// sort and merges them, writing the fields of left followed by those
+// of right to out as CSV for each pair of records with equal keys;
+// returns false if a key does not exist, the keys have different
+// types or a temporary file can't be created
+bool csv_merge_join( FILE *left, FILE *right, bool has_header, char *left_key, char *right_key, enum joins type, FILE *out, size_t memory ){
+	csv_reader *lreader, *rreader;
+	csv_record *a, *b, **group;
+	csv_field **header;
+	enum directions asc = ASC;
+	merger l, r;
+	void **cells;
+	bool ok;
+	int i, n, cap, rlen;
+
+	lreader = csv_open_reader( left, has_header );
+	rreader = csv_open_reader( right, has_header );
+	ok = make_runs( lreader, 1, &left_key, &asc, memory / 2, &l );
+	ok = make_runs( rreader, 1, &right_key, &asc, memory / 2, &r ) && ok;
+	if( ok && l.header[l.fields[0]]->type != r.header[r.fields[0]]->type )
+	// Error: Type mismatch
+		ok = false;
+	if( !ok ){
+		free_merger( &l );
+		free_merger( &r );
+		csv_close_reader( lreader );
+		csv_close_reader( rreader );
+		return false;
+	}
+
+	rlen = l.rlen + r.rlen;
+	header = (csv_field **) malloc( rlen * sizeof( csv_field * ) );
+	for( i = 0; i < rlen; i++ )
+		header[i] = i < l.rlen ? l.header[i] : r.header[i-l.rlen];
+	cells = (void **) malloc( rlen * sizeof( void * ) );
+	if( has_header )
+		csv_write_header( out, rlen, header );
+
+	cap = 16;
+	group = (csv_record **) malloc( cap * sizeof( csv_record * ) );
+	a = merge_next( &l );
+	b = merge_next( &r );
+	while( a ){
+		// Skip right records with smaller keys
+		while( b && compare_keys( &l, &r, a, b ) > 0 ){
+			free_row( r.rlen, b );
+			b = merge_next( &r );
+		}
+		if( !b || compare_keys( &l, &r, a, b ) < 0 ){
+			// No match
+			if( type == LEFT_JOIN )
+				write_pair( out, &l, &r, header, cells, a, NULL );
+			free_row( l.rlen, a );
+			a = merge_next( &l );
+			continue;
+		}
+		// Collect the right records with this key, then pair them
+		// with every left record with the same key
+		n = 0;
+		while( b && !compare_keys( &l, &r, a, b ) ){
+			if( n == cap ){
+				cap <<= 1;
+				group = (csv_record **) realloc( group, cap * sizeof( csv_record * ) );
+			}
+			group[n++] = b;
+			b = merge_next( &r );
+		}
+		do{
+			for( i = 0; i < n; i++ )
+				write_pair( out, &l, &r, header, cells, a, group[i] );
+			free_row( l.rlen, a );
+			a = merge_next( &l );
+		}while( a && !compare_keys( &l, &r, a, group[0] ) );
+		for( i = 0; i < n; i++ )
+			free_row( r.rlen, group[i] );
+	}
+	if( b )
+		free_row( r.rlen, b );
+
+	free( group );
+	free( cells );
+	free( header );
+	free_merger( &l );
+	free_merger( &r );
+	csv_close_reader( lreader );
+	csv_close_reader( rreader );
+	return true;
+}
@@ -12,12 +12,16 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <math.h>
 #include "csv.h"
 #include "automata.h"
 #include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
 
 // Used in case the last line of the
 // file is not newline-terminated
@@ -309,34 +313,224 @@ bool csv_validate_file( FILE *fp, bool has_header ){
 	return (state == FINAL);
 }
 
-// Reads a CSV table from a file
-csv_table *csv_read_table( FILE *fp, bool has_header ){
-	long pos;
-	dfloat64_t *tmpf;
-	csv_table *table;
-	int i, f, c, x, state, len, size;
-	char *buf = NULL;
+// Values seen in the sample of a field
+typedef struct {
+	bool string;    // A value is quoted or is not a number
+	bool fraction;  // A value is not an integer
+	int places;     // Largest # of digits of an integer
+	int64_t imax;   // Largest magnitude of an integer
+	int digits;     // Largest # of significant digits
+	int emin;       // Smallest and largest exponents
+	int emax;
+	bool seen;      // At least one nonzero number was seen
+} field_sample;
+
+// Adds an unquoted value to the sample of a field; values that are
+// not numbers make the field a string field
+static void sample_number( field_sample *sample, char *str ){
+	int n, zeros, frac, exponent;
+	int64_t whole;
+	bool sign, point, any;
+	n = zeros = frac = 0;
+	whole = 0;
+	point = any = false;
+	if( (sign = (*str == '-')) ) str++;
+	for( ; *str; str++ ){
+		if( *str == '.' && !point ){
+			point = true;
+			continue;
+		}
+		if( !isdigit( (unsigned char) *str ) ){
+			sample->string = true;
+			return;
+		}
+		any = true;
+		if( point ) frac++;
+		else if( whole < INT64_MAX / 100 ) whole = whole * 10 + (*str - '0');
+		// Count significant digits and the zeros that end them
+		if( *str != '0' ){
+			n++;
+			zeros = 0;
+		}
+		else if( n ){
+			n++;
+			zeros++;
+		}
+	}
+	if( !any ){
+		// Empty values are read as 0; a lone sign or point is not a number
+		if( sign || point ) sample->string = true;
+		return;
+	}
+	if( !(n -= zeros) )
+		return; // Zero fits in every storage
+	exponent = zeros - frac;
+	if( exponent < 0 )
+		sample->fraction = true;
+	else{
+		if( n + exponent > sample->places )
+			sample->places = n + exponent;
+		if( whole > sample->imax )
+			sample->imax = whole;
+	}
+	if( n > sample->digits )
+		sample->digits = n;
+	if( !sample->seen || exponent < sample->emin )
+		sample->emin = exponent;
+	if( !sample->seen || exponent > sample->emax )
+		sample->emax = exponent;
+	sample->seen = true;
+}
+
+// Adds the values of a line to the samples of the fields
+static void sample_line( char *buf, int rlen, field_sample *samples ){
+	char *end;
+	char save;
+	int f;
+	for( f = 0; f < rlen && *buf && *buf != '\r' && *buf != '\n'; f++ ){
+		if( *buf == '\"' ){
+			samples[f].string = true;
+			if( (end = strchr( buf + 1, '\"' )) )
+				buf = end + 1;
+			else
+				break;
+			end = buf + strcspn( buf, ",\r\n" );
+		}
+		else{
+			end = buf + strcspn( buf, ",\r\n" );
+			save = *end;
+			*end = '\0';
+			sample_number( samples + f, buf );
+			*end = save;
+		}
+		if( *end != ',' )
+			break;
+		buf = end + 1;
+	}
+}
+
+// Infers the type of each field of a reader from a sample of its
+// lines, starting at the current position of the file: a field is a
+// number field if none of its sampled values is quoted and all of
+// them are numbers, in which case its width is the narrowest type
+// that holds them all. With the native_numbers option, number fields
+// get the type csv_int64 if their width is csv_integer32 or
+// csv_integer64, and csv_double otherwise.
+static void sample_types( csv_reader *reader ){
+	csv_reader_options *opt;
+	field_sample *samples, *sample;
+	long start, end;
+	int i, f;
+	opt = &reader->options;
+	samples = (field_sample *) calloc( reader->rlen, sizeof( field_sample ) );
+	start = ftell( reader->fp );
+	end = start;
+	if( opt->sample_spread ){
+		fseek( reader->fp, 0, SEEK_END );
+		end = ftell( reader->fp );
+		fseek( reader->fp, start, SEEK_SET );
+	}
+	for( i = 0; i < opt->sample_rows && !is_eof( reader->fp ); i++ ){
+		if( opt->sample_spread && i ){
+			// Skip to the start of the line after the chosen offset
+			fseek( reader->fp, start + (long) ((double) (end - start) * i / opt->sample_rows) - 1, SEEK_SET );
+			read_line( reader->buf, reader->size, reader->fp );
+			if( is_eof( reader->fp ) )
+				break;
+		}
+		read_line( reader->buf, reader->size, reader->fp );
+		sample_line( reader->buf, reader->rlen, samples );
+	}
+
+	for( f = 0; f < reader->rlen; f++ ){
+		sample = samples + f;
+		if( sample->string ){
+			reader->header[f]->type = csv_string;
+			continue;
+		}
+		if( !sample->fraction && sample->places <= 10 && sample->imax <= INT32_MAX )
+			reader->header[f]->width = csv_integer32;
+		else if( !sample->fraction && sample->places <= 18 )
+			reader->header[f]->width = csv_integer64;
+		else if( sample->digits <= 2 && sample->emin >= INT8_MIN && sample->emax <= INT8_MAX )
+			reader->header[f]->width = csv_dfloat16;
+		else if( sample->digits <= 4 && sample->emin >= INT16_MIN && sample->emax <= INT16_MAX )
+			reader->header[f]->width = csv_dfloat32;
+		else if( sample->digits <= 9 )
+			reader->header[f]->width = csv_dfloat64;
+		else
+			reader->header[f]->width = csv_dfloat128;
+		if( opt->native_numbers ){
+			if( reader->header[f]->width == csv_integer32 || reader->header[f]->width == csv_integer64 )
+				reader->header[f]->type = csv_int64;
+			else
+				reader->header[f]->type = csv_double;
+		}
+	}
+	free( samples );
+}
+
+// Sets every reader option to its default: CSV_SAMPLE_ROWS lines from
+// the beginning of the file, and number fields read as csv_number
+void csv_reader_defaults( csv_reader_options *options ){
+	options->sample_rows = CSV_SAMPLE_ROWS;
+	options->sample_spread = false;
+	options->native_numbers = false;
+}
+
+// Opens a streaming reader on a CSV file with the default options
+csv_reader *csv_open_reader( FILE *fp, bool has_header ){
+	return csv_open_reader_with( fp, has_header, NULL );
+}
+
+// Opens a streaming reader on a CSV file: determines the names and
+// types of the fields and leaves the file at the first record; options
+// may be NULL for the defaults
+csv_reader *csv_open_reader_with( FILE *fp, bool has_header, csv_reader_options *options ){
+	csv_reader *reader;
+	int i, f, x, state, len;
+	char *buf;
 	char *ptr = NULL;
-	pos = ftell( fp );
 	rewind( fp );
-	table = (csv_table *) malloc( sizeof( csv_table ) );
+	reader = (csv_reader *) malloc( sizeof( csv_reader ) );
+	reader->fp = fp;
+	if( options )
+		reader->options = *options;
+	else
+		csv_reader_defaults( &reader->options );
+	if( reader->options.sample_rows < 1 )
+		reader->options.sample_rows = 1;
+	reader->buf = NULL;
+	reader->row = 0;
+	reader->columns = NULL;
+	reader->filters = NULL;
+	reader->nfilters = 0;
+	reader->line = 0;
+	reader->nsketches = 0;
+	reader->sketch_fields = NULL;
+	reader->sketches = NULL;
+	reader->histograms = NULL;
+	reader->ncounters = 0;
+	reader->counter_fields = NULL;
+	reader->counters = NULL;
 
 	// Field-counting automaton:
-	table->rlen = 1;
+	reader->rlen = 1;
 	state = OUT;
-	read_line( buf, size, fp );
+	read_line( reader->buf, reader->size, fp );
+	buf = reader->buf;
 	len = strlen( buf );
 	for( i = 0; i < len; i++ ){
 		if( state == OUT ){
 			if( buf[i] == '\"' ) state = IN;
-			else if( buf[i] == ',' ) (table->rlen)++;
+			else if( buf[i] == ',' ) (reader->rlen)++;
 		}
 		else if( state == IN && buf[i] == '\"' ) state = OUT;
 	}
 
-	table->header = (csv_field **) calloc( table->rlen, sizeof( csv_field * ) );
-	for( f = 0; f < table->rlen; f++ ){
-		table->header[f] = (csv_field *) malloc( sizeof( csv_field ) );
+	reader->header = (csv_field **) calloc( reader->rlen, sizeof( csv_field * ) );
+	for( f = 0; f < reader->rlen; f++ ){
+		reader->header[f] = (csv_field *) malloc( sizeof( csv_field ) );
 	}
 
 	// Determine field names:
@@ -353,62 +547,241 @@ csv_table *csv_read_table( FILE *fp, bool has_header ){
 		}
 		// Read field strings:
 		ptr = buf + 1;
-		for( f = 0; f < table->rlen; f++ ){
+		for( f = 0; f < reader->rlen; f++ ){
 			len = strlen( ptr );
-			table->header[f]->name = (char *) malloc( len + 1 );
-			strncpy( table->header[f]->name, ptr, len + 1 );
+			reader->header[f]->name = (char *) malloc( len + 1 );
+			strncpy( reader->header[f]->name, ptr, len + 1 );
 			ptr += len;
-			while( ptr[0] == '\0' ) ptr++;
+			// Don't run past the end of the line after the last field
+			while( f < reader->rlen - 1 && ptr[0] == '\0' ) ptr++;
 		}
 	}
 	else{
-		for( f = 0; f < table->rlen; f++ ){
+		for( f = 0; f < reader->rlen; f++ ){
 			// Format for field names will be "x<number>"
 			x = ceil( log( (double) i ) / log( 10.0 ) ) + 2;
-			table->header[f]->name = (char *) malloc( x );
-			snprintf( table->header[f]->name, x, "x%d\0", f );
+			reader->header[f]->name = (char *) malloc( x );
+			snprintf( reader->header[f]->name, x, "x%d\0", f );
 		}
 	}
 
-	// Automaton to determine types of fields:
+	// Determine the types of the fields from a sample of lines:
+	for( f = 0; f < reader->rlen; f++ ){
+		reader->header[f]->type = csv_number;
+		reader->header[f]->width = csv_dfloat64;
+	}
 	if( !has_header ) rewind( fp );
-	state = START;
-	read_line( buf, size, fp );
-	len = strlen( buf );
-	f = 0;
-	for( i = 0; i < len; i++ ){
-		if( state == START ){
-			if( buf[i] == '\"' ){
-				state = IN;
-				table->header[f]->type = csv_string;
-			}
-			else{
-				state = OUT;
-				table->header[f]->type = csv_number;
-			}
-			f++;
+	sample_types( reader );
+
+	// Go back to the first record:
+	rewind( fp );
+	if( has_header ) read_line( reader->buf, reader->size, fp );
+	reader->flen = reader->rlen;
+	reader->fields = reader->header;
+	reader->cells = (char **) malloc( reader->flen * sizeof( char * ) );
+	return reader;
+}
+
+// Restricts the records of a reader to the n fields named in names,
+// in that order; the other fields are still scanned but never copied
+// or converted. Returns false if a name does not exist or is given
+// twice, in which case the reader is left unchanged.
+bool csv_reader_select( csv_reader *reader, int n, char **names ){
+	csv_field **header;
+	int *columns;
+	int i, f;
+	if( reader->columns )
+	// Error: Fields already selected
+		return false;
+	columns = (int *) malloc( reader->flen * sizeof( int ) );
+	for( f = 0; f < reader->flen; f++ )
+		columns[f] = -1;
+	for( i = 0; i < n; i++ ){
+		for( f = 0; f < reader->flen; f++ ){
+			if( !strcmp( reader->fields[f]->name, names[i] ) )
+				break;
 		}
-		if( state == IN ){
-			if( buf[i] == '\"' )
-				state = OUT;
+		if( f == reader->flen || columns[f] >= 0 ){
+		// Error: Name not found or duplicated
+			free( columns );
+			return false;
 		}
-		if( state == OUT ){
-			if( buf[i] == ',' )
-				state = START;	
+		columns[f] = i;
+	}
+
+	// The header only lists the selected fields, but the reader
+	// keeps every field so that it can still filter on them
+	header = (csv_field **) calloc( n ? n : 1, sizeof( csv_field * ) );
+	for( f = 0; f < reader->flen; f++ ){
+		if( columns[f] >= 0 )
+			header[columns[f]] = reader->fields[f];
+	}
+	reader->header = header;
+	reader->columns = columns;
+	reader->rlen = n;
+	return true;
+}
+
+// Adds a condition to a streaming reader: lines that don't satisfy
+// it are discarded by csv_read_record() as soon as they have been
+// split into fields, before anything is allocated for them. The
+// condition is the same as for csv_select_subset() and may use any
+// field of the file, even one left out by csv_reader_select(); MOD
+// applies to the number of the line among the lines of the file.
+// Returns false if the condition is invalid.
+bool csv_reader_where( csv_reader *reader, enum operators operator, char *field, char *value ){
+	csv_predicate *pred;
+	csv_table fields;
+	// Resolve the condition against every field of the file
+	fields.rlen = reader->flen;
+	fields.header = reader->fields;
+	if( !(pred = csv_prepare_predicate( &fields, operator, field, value )) )
+	// Error: Invalid condition
+		return false;
+	reader->filters = (csv_predicate **) realloc( reader->filters, (reader->nfilters + 1) * sizeof( csv_predicate * ) );
+	reader->filters[reader->nfilters++] = pred;
+	return true;
+}
+
+// Feeds the values of a number, int64 or double field to a sketch
+// and a histogram, either of which may be NULL, as csv_read_record()
+// reads the records that pass the conditions of the reader; the field
+// may be any field of the file, even one left out by
+// csv_reader_select(). The reader never frees the sketch or the
+// histogram. Returns false if the field does not exist or is a
+// string field.
+bool csv_reader_sketch( csv_reader *reader, char *field, csv_sketch *sketch, csv_histogram *hist ){
+	int f, n;
+	for( f = 0; f < reader->flen; f++ ){
+		if( !strcmp( reader->fields[f]->name, field ) )
+			break;
+	}
+	if( f == reader->flen || reader->fields[f]->type == csv_string )
+	// Error: Name not found or type mismatch
+		return false;
+	n = reader->nsketches + 1;
+	reader->sketch_fields = (int *) realloc( reader->sketch_fields, n * sizeof( int ) );
+	reader->sketches = (csv_sketch **) realloc( reader->sketches, n * sizeof( csv_sketch * ) );
+	reader->histograms = (csv_histogram **) realloc( reader->histograms, n * sizeof( csv_histogram * ) );
+	reader->sketch_fields[reader->nsketches] = f;
+	reader->sketches[reader->nsketches] = sketch;
+	reader->histograms[reader->nsketches] = hist;
+	reader->nsketches = n;
+	return true;
+}
+
+// Feeds the values of a field to a distinct counter as
+// csv_read_record() reads the records that pass the conditions of
+// the reader; values are counted like csv_approx_distinct() counts
+// them. The field may be any field of the file, even one left out by
+// csv_reader_select(). The reader never frees the counter. Returns
+// false if the field does not exist.
+bool csv_reader_distinct( csv_reader *reader, char *field, csv_hll *hll ){
+	int f, n;
+	for( f = 0; f < reader->flen; f++ ){
+		if( !strcmp( reader->fields[f]->name, field ) )
+			break;
+	}
+	if( f == reader->flen )
+	// Error: Name not found
+		return false;
+	n = reader->ncounters + 1;
+	reader->counter_fields = (int *) realloc( reader->counter_fields, n * sizeof( int ) );
+	reader->counters = (csv_hll **) realloc( reader->counters, n * sizeof( csv_hll * ) );
+	reader->counter_fields[reader->ncounters] = f;
+	reader->counters[reader->ncounters] = hll;
+	reader->ncounters = n;
+	return true;
+}
+
+// Adds the value of field f of the current line to a distinct
+// counter, parsed as it would be stored in a table
+static void count_cell( csv_reader *reader, int f, csv_hll *hll ){
+	csv_table fields;
+	void *cell;
+	fields.rlen = reader->flen;
+	fields.header = reader->fields;
+	if( reader->fields[f]->type == csv_string ){
+		csv_hll_add_cell( hll, &fields, f, reader->cells[f] );
+		return;
+	}
+	cell = csv_parse_cell( reader->fields[f]->type, reader->cells[f] );
+	csv_hll_add_cell( hll, &fields, f, cell );
+	free( cell );
+}
+
+// Evaluates a numerical comparison on the text of an int64 or
+// double field
+static bool keep_native( csv_predicate *pred, char *str ){
+	int64_t i;
+	double d;
+	int c;
+	if( pred->type == csv_int64 ){
+		if( !pred->whole && (pred->operator == EQ || pred->operator == NE || pred->real != pred->real) )
+		// A fraction never equals an integer, and NaN equals nothing
+			return pred->operator == NE;
+		i = strtoll( str, NULL, 10 );
+		c = (i > pred->integer) - (i < pred->integer);
+	}
+	else{
+		d = strtod( str, NULL );
+		// NaN fails every comparison but NE
+		if( d != d || pred->real != pred->real )
+			return pred->operator == NE;
+		c = (d > pred->real) - (d < pred->real);
+	}
+	return (csv_cmp_masks[pred->operator] >> (c + 1)) & 1;
+}
+
+// Returns true if the fields of the current line satisfy every
+// condition of a reader
+static bool keep_line( csv_reader *reader, int line ){
+	csv_predicate *pred;
+	dfloat64_t *tmpf;
+	int i, c;
+	for( i = 0; i < reader->nfilters; i++ ){
+		pred = reader->filters[i];
+		switch( pred->operator ){
+			case MOD :
+				c = (line % pred->modulus == pred->residue);
+				break;
+			case SEQ :
+				c = !strcmp( reader->cells[pred->field], pred->string );
+				break;
+			case SNE :
+				c = strcmp( reader->cells[pred->field], pred->string ) != 0;
+				break;
+			default :
+				if( pred->type == csv_int64 || pred->type == csv_double ){
+					c = keep_native( pred, reader->cells[pred->field] );
+					break;
+				}
+				tmpf = dfloat64_atof( reader->cells[pred->field] );
+				c = (csv_cmp_masks[pred->operator] >> (dfloat64_cmp( tmpf, &pred->number ) + 1)) & 1;
+				free( tmpf );
+				break;
 		}
+		if( !c )
+			return false;
 	}
+	return true;
+}
 
-	// Code to build the table structure:
-	rewind( fp );
-	table->start = (csv_record *) calloc( 1, sizeof( csv_record ) );
-	table->cur = table->start;
-	if( has_header ) read_line( buf, size, fp );
-	while( (c = fgetc( fp )) != EOF ){
-		table->cur->next = (csv_record *) calloc( 1, sizeof( csv_record ) );
-		table->cur = table->cur->next;
-		table->cur->record = (void **) calloc( table->rlen, sizeof( void * ) );
-		ungetc( c, fp );
-		read_line( buf, size, fp );
+// Reads the next record from a streaming reader; returns NULL at
+// the end of the file
+csv_record *csv_read_record( csv_reader *reader ){
+	csv_record *rec;
+	dfloat64_t *tmpf;
+	double x;
+	int i, f, c, state, len;
+	char *buf;
+	char *ptr = NULL;
+	do{
+		if( (c = fgetc( reader->fp )) == EOF )
+			return NULL;
+		ungetc( c, reader->fp );
+		read_line( reader->buf, reader->size, reader->fp );
+		buf = reader->buf;
 		len = strlen( buf );
 		// Isolate field strings:
 		state = OUT;
@@ -420,84 +793,244 @@ csv_table *csv_read_table( FILE *fp, bool has_header ){
 			else if( state == IN && buf[i] == '\"' ) state = OUT;
 			if( buf[i] == '\"' || buf[i] == '\r' || buf[i] == '\n' ) buf[i] = '\0';
 		}
-		// Read field strings:
+		// Find the start of each field string:
 		ptr = buf;
 		while( ptr[0] == '\0' ) ptr++;
-		for( f = 0; f < table->rlen; f++ ){
+		for( f = 0; f < reader->flen; f++ ){
+			reader->cells[f] = ptr;
+			ptr += strlen( ptr );
+			// Don't run past the end of the line after the last field
+			while( f < reader->flen - 1 && ptr[0] == '\0' ) ptr++;
+		}
+	}while( !keep_line( reader, reader->line++ ) );
+
+	// Feed the summaries before the cells are copied:
+	for( i = 0; i < reader->nsketches; i++ ){
+		x = strtod( reader->cells[reader->sketch_fields[i]], NULL );
+		if( reader->sketches[i] )
+			csv_sketch_add( reader->sketches[i], x );
+		if( reader->histograms[i] )
+			csv_histogram_add( reader->histograms[i], x );
+	}
+	for( i = 0; i < reader->ncounters; i++ )
+		count_cell( reader, reader->counter_fields[i], reader->counters[i] );
+
+	// Copy the selected fields:
+	rec = (csv_record *) calloc( 1, sizeof( csv_record ) );
+	rec->row = reader->row++;
+	rec->record = (void **) calloc( reader->rlen, sizeof( void * ) );
+	for( f = 0; f < reader->flen; f++ ){
+		c = reader->columns ? reader->columns[f] : f;
+		ptr = reader->cells[f];
+		if( c < 0 )
+			continue; // Skipped field
+		if( reader->header[c]->type == csv_string ){
 			len = strlen( ptr );
-			if( table->header[f]->type == csv_string ){
-				table->cur->record[f] = malloc( len + 1 );
-				strncpy( table->cur->record[f], ptr, len + 1 );
-			}
-			else if( table->header[f]->type == csv_number ){
-				table->cur->record[f] = malloc( sizeof( dfloat64_t ) );
-				tmpf = dfloat64_atof( ptr );
-				memcpy( table->cur->record[f], tmpf, sizeof( dfloat64_t ) );
-			}
-			ptr += len;
-			while( ptr[0] == '\0' ) ptr++;
+			rec->record[c] = malloc( len + 1 );
+			strncpy( rec->record[c], ptr, len + 1 );
+		}
+		else if( reader->header[c]->type == csv_number ){
+			tmpf = dfloat64_atof( ptr );
+			rec->record[c] = tmpf; // tmpf was malloc'ed by dfloat64_atof()
 		}
+		else
+			rec->record[c] = csv_parse_cell( reader->header[c]->type, ptr );
+	}
+	return rec;
+}
+
+// Frees a record returned by csv_read_record()
+void csv_free_record( csv_reader *reader, csv_record *rec ){
+	int f;
+	for( f = 0; f < reader->rlen; f++ )
+		free( rec->record[f] );
+	free( rec->record );
+	free( rec );
+}
+
+// Closes a streaming reader, but not its file
+void csv_close_reader( csv_reader *reader ){
+	int f;
+	for( f = 0; f < reader->flen; f++ ){
+		free( reader->fields[f]->name );
+		free( reader->fields[f] );
+	}
+	if( reader->header != reader->fields )
+		free( reader->header );
+	free( reader->fields );
+	for( f = 0; f < reader->nfilters; f++ )
+		csv_free_predicate( reader->filters[f] );
+	free( reader->filters );
+	free( reader->sketch_fields );
+	free( reader->sketches );
+	free( reader->histograms );
+	free( reader->counter_fields );
+	free( reader->counters );
+	free( reader->columns );
+	free( reader->cells );
+	free( reader->buf );
+	free( reader );
+}
+
+// Reads the remaining records of a reader into a new table with a
+// copy of the header of the reader, so that a table can be read with
+// the fields, conditions and summaries of a reader
+csv_table *csv_read_records( csv_reader *reader ){
+	csv_table *table;
+	csv_record *rec;
+	size_t len;
+	int f;
+	table = (csv_table *) malloc( sizeof( csv_table ) );
+	table->rlen = reader->rlen;
+	table->header = (csv_field **) calloc( reader->rlen ? reader->rlen : 1, sizeof( csv_field * ) );
+	for( f = 0; f < reader->rlen; f++ ){
+		table->header[f] = (csv_field *) malloc( sizeof( csv_field ) );
+		table->header[f]->type = reader->header[f]->type;
+		table->header[f]->width = reader->header[f]->width;
+		len = strlen( reader->header[f]->name ) + 1;
+		table->header[f]->name = (char *) malloc( len );
+		memcpy( table->header[f]->name, reader->header[f]->name, len );
+	}
+	table->indexes = NULL;
+	table->zones = NULL;
+	table->zcount = 0;
+	table->view = false;
+	table->own_names = true;
+	table->fixed = NULL;
+	table->scales = NULL;
+
+	// Code to build the table structure:
+	table->start = (csv_record *) calloc( 1, sizeof( csv_record ) );
+	table->cur = table->start;
+	while( (rec = csv_read_record( reader )) ){
+		table->cur->next = rec;
+		table->cur = rec;
+		csv_zone_add( table, rec );
 	}
 	table->cur = table->start;
+	// Store number fields in fixed point where their values allow it
+	for( f = 0; f < table->rlen; f++ ){
+		if( table->header[f]->type == csv_number )
+			csv_fix_field( table, f );
+	}
+	return table;
+}
+
+// Reads a CSV table from a file
+csv_table *csv_read_table( FILE *fp, bool has_header ){
+	return csv_read_table_with( fp, has_header, NULL );
+}
 
+// Same as csv_read_table(), but with the given reader options, or the
+// defaults if options is NULL
+csv_table *csv_read_table_with( FILE *fp, bool has_header, csv_reader_options *options ){
+	long pos;
+	csv_reader *reader;
+	csv_table *table;
+	pos = ftell( fp );
+	reader = csv_open_reader_with( fp, has_header, options );
+	table = csv_read_records( reader );
+	csv_close_reader( reader );
 	fseek( fp, pos, SEEK_SET );
 	return table;
 }
 
-// Writes a CSV table to a file, starting at the current file
-// position, can be used multiple times with different tables
-// to concatenate them into one file
-void csv_write_table( FILE *fp, csv_table *table, bool has_header ){
-	csv_record *saved;
-	dfloat64_t *tmpf;
-	char *tmpstr;
+// Reads only the n fields named in names from a CSV file into a new
+// table, in that order; returns NULL if a name does not exist or is
+// given twice
+csv_table *csv_read_table_columns( FILE *fp, bool has_header, char **names, int n ){
+	long pos;
+	csv_reader *reader;
+	csv_table *table;
+	pos = ftell( fp );
+	reader = csv_open_reader( fp, has_header );
+	table = NULL;
+	if( csv_reader_select( reader, n, names ) )
+		table = csv_read_records( reader );
+	csv_close_reader( reader );
+	fseek( fp, pos, SEEK_SET );
+	return table;
+}
+
+// Reads only the records of a CSV file that satisfy a condition into
+// a new table, without ever allocating the others; the condition is
+// the same as for csv_select_subset(). Returns NULL if the condition
+// is invalid.
+csv_table *csv_read_table_where( FILE *fp, bool has_header, enum operators operator, char *field, char *value ){
+	long pos;
+	csv_reader *reader;
+	csv_table *table;
+	pos = ftell( fp );
+	reader = csv_open_reader( fp, has_header );
+	table = NULL;
+	if( csv_reader_where( reader, operator, field, value ) )
+		table = csv_read_records( reader );
+	csv_close_reader( reader );
+	fseek( fp, pos, SEEK_SET );
+	return table;
+}
+
+// Writes the header line for records with the given fields
+void csv_write_header( FILE *fp, int rlen, csv_field **header ){
+	int f;
+	f = 0;
+	while( f < rlen ){
+		fputc( '"', fp );
+		fputs( header[f]->name, fp );
+		fputc( '"', fp );
+		if( (++f) == rlen )
+			fputs( _EOL_, fp );
+		else
+			fputc( ',', fp );
+	}
+}
+
+// Writes a single record with the given fields as a line of CSV;
+// returns false if a string contains characters that cannot be
+// written
+bool csv_write_record( FILE *fp, int rlen, csv_field **header, void **record ){
 	char *fstr;
 	int f;
-	int i;
-	int len;
-	tmpf = (dfloat64_t *) malloc( sizeof( dfloat64_t ) );
-	if( has_header ){
-		f = 0;
-		while( f < table->rlen ){
+	for( f = 0; f < rlen; f++ ){
+		if( header[f]->type == csv_string && strpbrk( (char *) record[f], "\"\n" ) ){
+			fprintf( stderr, "String contains invalid characters.\n" );
+			return false;
+		}
+	}
+	f = 0;
+	while( f < rlen ){
+		if( header[f]->type == csv_string ){
 			fputc( '"', fp );
-			fputs( table->header[f]->name, fp );
+			fputs( (char *) record[f], fp );
 			fputc( '"', fp );
-			if( (++f) == table->rlen )
-				fputs( _EOL_, fp );
-			else
-				fputc( ',', fp );
 		}
-	}
-	saved = table->cur;
-	table->cur = table->start;
-	while( table->cur->next ){
-		table->cur = table->cur->next;
-		f = 0;
-		while( f < table->rlen ){
-			if( table->header[f]->type == csv_string ){
-				len = strlen( (char *) table->cur->record[f] );
-				tmpstr = (char *) malloc( len + 1 );
-				strncpy( tmpstr, table->cur->record[f], len + 1 );
-				for( i = 0; i < len; i++ ){
-					if( tmpstr[i] == '"' || tmpstr[i] == '\n' ){
-						fprintf( stderr, "String contains invalid characters.\n" );
-						return;
-					}
-				}
-				fputc( '"', fp );
-				fputs( (char *) tmpstr, fp );
-				fputc( '"', fp );
-			}
-			else if( table->header[f]->type == csv_number ){
-				memcpy( tmpf, table->cur->record[f], sizeof( dfloat64_t ) );
-				fstr = dfloat64_ftoa( tmpf );
-				fputs( fstr, fp );
-				free( fstr ); // fstr was malloc'ed by dfloat64_ftoa()
-			}
-			if( (++f) == table->rlen )
-				fputs( _EOL_, fp );
-			else
-				fputc( ',', fp );
+		else if( header[f]->type == csv_number ){
+			fstr = dfloat64_ftoa( (dfloat64_t *) record[f] );
+			fputs( fstr, fp );
+			free( fstr ); // fstr was malloc'ed by dfloat64_ftoa()
 		}
+		else if( header[f]->type == csv_int64 )
+			fprintf( fp, "%" PRId64, *(int64_t *) record[f] );
+		else if( header[f]->type == csv_double )
+			// 17 significant digits read back as the same double
+			fprintf( fp, "%.17g", *(double *) record[f] );
+		if( (++f) == rlen )
+			fputs( _EOL_, fp );
+		else
+			fputc( ',', fp );
+	}
+	return true;
+}
+
+// Writes a CSV table to a file, starting at the current file
+// position, can be used multiple times with different tables
+// to concatenate them into one file
+void csv_write_table( FILE *fp, csv_table *table, bool has_header ){
+	csv_record *rec;
+	if( has_header )
+		csv_write_header( fp, table->rlen, table->header );
+	for( rec = table->start->next; rec; rec = rec->next ){
+		if( !csv_write_record( fp, table->rlen, table->header, rec->record ) )
+			return;
 	}
 }
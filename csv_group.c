@@ -0,0 +1,664 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Implementation of SQL      *
+ *                 GROUP BY clause            *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
+
+/*
+ * Aggregation runs in two phases. First, each chunk of whole zones
+ * aggregates its own records into a private open-addressing hash
+ * table of groups and then sorts those groups into one bucket for
+ * each merge partition by their hash. Second, each merge partition
+ * combines the groups in its buckets from every chunk into a hash
+ * table of its own. Neither phase shares anything between threads.
+ *
+ * The resulting groups are listed in the order in which their first
+ * records appear in the table.
+ */
+
+// Running state of one aggregate within a group
+typedef struct {
+	csv_sum sum;     // Exact sum for AGG_SUM and AGG_AVG on number
+	                 // and int64 fields
+	double real;     // Sum for AGG_SUM and AGG_AVG on double fields
+	dfloat64_t min;  // Extremes for AGG_MIN and AGG_MAX on number fields
+	dfloat64_t max;
+	int64_t imin;    // on int64 fields
+	int64_t imax;
+	double dmin;     // and on double fields
+	double dmax;
+	double mean;     // Running mean and sum of squared deviations
+	double m2;       // from the mean for AGG_VAR
+} agg_state;
+
+// Group of records with equal keys
+typedef struct {
+	uint64_t hash;
+	csv_record *first; // Earliest record of the group
+	int count;         // # of records in the group
+	agg_state states[];
+} group;
+
+// Open-addressing hash table of groups
+typedef struct {
+	group **slots;
+	int capacity;
+	int count;
+} group_table;
+
+// State shared by the workers of an aggregation
+typedef struct {
+	csv_table *table;
+	csv_set *subset;                    // Rows to aggregate, or NULL for all
+	int nkeys;
+	int *keys;                          // Key fields
+	int naggs;
+	int *fields;                        // Aggregated fields
+	enum types *types;                  // Types of the aggregated fields
+	enum aggregates *functions;
+	int nchunks;
+	csv_record *first[CSV_MAX_THREADS]; // First record of each chunk
+	int count[CSV_MAX_THREADS];         // # of records in each chunk
+	group **buckets[CSV_MAX_THREADS * CSV_MAX_THREADS];
+	int bcount[CSV_MAX_THREADS * CSV_MAX_THREADS];
+	group_table merged[CSV_MAX_THREADS];
+} group_job;
+
+// Hashes the keys of a record
+static uint64_t hash_keys( group_job *job, csv_record *rec ){
+	uint64_t h;
+	int i;
+	h = 0;
+	for( i = 0; i < job->nkeys; i++ )
+		h = (h * 0x9e3779b97f4a7c15ULL) ^ csv_hash_cell( job->table, job->keys[i], rec->record[job->keys[i]] );
+	return h;
+}
+
+// Returns true if two records have equal keys
+static bool same_keys( group_job *job, csv_record *a, csv_record *b ){
+	int i, f;
+	for( i = 0; i < job->nkeys; i++ ){
+		f = job->keys[i];
+		if( csv_compare_cells( job->table->header[f]->type, a->record[f], b->record[f] ) )
+			return false;
+	}
+	return true;
+}
+
+// Partition of a group for the merge phase; uses the high bits of
+// the hash since the low bits pick the slot
+#define merge_partition( job, hash ) ((int) (((hash) >> 32) % (job)->nchunks))
+
+// Returns the slot of a hash table holding the group of a record,
+// or the empty slot where it belongs
+static int find_slot( group_job *job, group_table *gt, uint64_t hash, csv_record *rec ){
+	int slot;
+	slot = (int) (hash & (gt->capacity - 1));
+	while( gt->slots[slot] && (gt->slots[slot]->hash != hash || !same_keys( job, gt->slots[slot]->first, rec )) )
+		slot = (slot + 1) & (gt->capacity - 1);
+	return slot;
+}
+
+// Initializes an empty hash table
+static void init_table( group_table *gt ){
+	gt->capacity = 16;
+	gt->count = 0;
+	gt->slots = (group **) calloc( gt->capacity, sizeof( group * ) );
+}
+
+// Inserts a group into a hash table whose load is kept at or
+// below one half
+static void insert_group( group_table *gt, group *g ){
+	group **old;
+	int i, capacity, slot;
+	if( 2 * (gt->count + 1) > gt->capacity ){
+		old = gt->slots;
+		capacity = gt->capacity;
+		gt->capacity = capacity << 1;
+		gt->slots = (group **) calloc( gt->capacity, sizeof( group * ) );
+		for( i = 0; i < capacity; i++ ){
+			if( old[i] ){
+				slot = (int) (old[i]->hash & (gt->capacity - 1));
+				while( gt->slots[slot] )
+					slot = (slot + 1) & (gt->capacity - 1);
+				gt->slots[slot] = old[i];
+			}
+		}
+		free( old );
+	}
+	slot = (int) (g->hash & (gt->capacity - 1));
+	while( gt->slots[slot] )
+		slot = (slot + 1) & (gt->capacity - 1);
+	gt->slots[slot] = g;
+	gt->count++;
+}
+
+// Adds a value to the running mean and deviations of a group of
+// count values, with Welford's algorithm
+static void add_deviation( agg_state *st, int count, double x ){
+	double delta;
+	delta = x - st->mean;
+	st->mean += delta / count;
+	st->m2 += delta * (x - st->mean);
+}
+
+// Adds the value of an int64 field to an aggregate of a group of
+// count values
+static void accumulate_int64( agg_state *st, enum aggregates function, int count, int64_t x ){
+	switch( function ){
+		case AGG_SUM :
+		case AGG_AVG :
+			csv_sum_add( &st->sum, x, 0 );
+			break;
+		case AGG_MIN :
+			if( count == 1 || x < st->imin )
+				st->imin = x;
+			break;
+		case AGG_MAX :
+			if( count == 1 || x > st->imax )
+				st->imax = x;
+			break;
+		case AGG_VAR :
+			add_deviation( st, count, (double) x );
+			break;
+		default :
+			break;
+	}
+}
+
+// Adds the value of a double field to an aggregate of a group of
+// count values
+static void accumulate_double( agg_state *st, enum aggregates function, int count, double x ){
+	switch( function ){
+		case AGG_SUM :
+		case AGG_AVG :
+			st->real += x;
+			break;
+		case AGG_MIN :
+			if( count == 1 || x < st->dmin )
+				st->dmin = x;
+			break;
+		case AGG_MAX :
+			if( count == 1 || x > st->dmax )
+				st->dmax = x;
+			break;
+		case AGG_VAR :
+			add_deviation( st, count, x );
+			break;
+		default :
+			break;
+	}
+}
+
+// Adds the values of a record to the aggregates of its group
+static void accumulate( group_job *job, group *g, csv_record *rec ){
+	agg_state *st;
+	dfloat64_t *val;
+	int i;
+	g->count++;
+	for( i = 0; i < job->naggs; i++ ){
+		if( job->functions[i] == AGG_COUNT )
+			continue;
+		st = g->states + i;
+		if( job->types[i] == csv_int64 ){
+			accumulate_int64( st, job->functions[i], g->count, *(int64_t *) rec->record[job->fields[i]] );
+			continue;
+		}
+		if( job->types[i] == csv_double ){
+			accumulate_double( st, job->functions[i], g->count, *(double *) rec->record[job->fields[i]] );
+			continue;
+		}
+		val = (dfloat64_t *) rec->record[job->fields[i]];
+		switch( job->functions[i] ){
+			case AGG_SUM :
+			case AGG_AVG :
+				if( csv_is_fixed( job->table, job->fields[i] ) ){
+					// Fixed-point mantissas share one exponent, and fewer
+					// than 2^31 of them cannot overflow 64 bits
+					st->sum.m += csv_fixed_mantissa( val, job->table->scales[job->fields[i]] );
+					st->sum.e = job->table->scales[job->fields[i]];
+				}
+				else
+					csv_sum_add( &st->sum, val->mantissa, val->exponent );
+				break;
+			case AGG_MIN :
+				if( g->count == 1 || dfloat64_cmp( val, &st->min ) < 0 )
+					st->min = *val;
+				break;
+			case AGG_MAX :
+				if( g->count == 1 || dfloat64_cmp( val, &st->max ) > 0 )
+					st->max = *val;
+				break;
+			case AGG_VAR :
+				add_deviation( st, g->count, csv_dfloat_to_double( val ) );
+				break;
+			default :
+				break;
+		}
+	}
+}
+
+// Combines group b into group a, where both have the same keys
+static void combine( group_job *job, group *a, group *b ){
+	agg_state *sa, *sb;
+	double delta, n;
+	int i;
+	for( i = 0; i < job->naggs; i++ ){
+		sa = a->states + i;
+		sb = b->states + i;
+		switch( job->functions[i] ){
+			case AGG_SUM :
+			case AGG_AVG :
+				if( job->types[i] == csv_double )
+					sa->real += sb->real;
+				else
+					csv_sum_add( &sa->sum, sb->sum.m, sb->sum.e );
+				break;
+			case AGG_MIN :
+				if( job->types[i] == csv_int64 ){
+					if( sb->imin < sa->imin )
+						sa->imin = sb->imin;
+				}
+				else if( job->types[i] == csv_double ){
+					if( sb->dmin < sa->dmin )
+						sa->dmin = sb->dmin;
+				}
+				else if( dfloat64_cmp( &sb->min, &sa->min ) < 0 )
+					sa->min = sb->min;
+				break;
+			case AGG_MAX :
+				if( job->types[i] == csv_int64 ){
+					if( sb->imax > sa->imax )
+						sa->imax = sb->imax;
+				}
+				else if( job->types[i] == csv_double ){
+					if( sb->dmax > sa->dmax )
+						sa->dmax = sb->dmax;
+				}
+				else if( dfloat64_cmp( &sb->max, &sa->max ) > 0 )
+					sa->max = sb->max;
+				break;
+			case AGG_VAR :
+				// Parallel form of Welford's algorithm
+				n = (double) a->count + b->count;
+				delta = sb->mean - sa->mean;
+				sa->mean += delta * b->count / n;
+				sa->m2 += sb->m2 + delta * delta * a->count * b->count / n;
+				break;
+			default :
+				break;
+		}
+	}
+	a->count += b->count;
+	if( b->first->row < a->first->row )
+		a->first = b->first;
+}
+
+// Aggregates chunks lo through hi - 1 into private hash tables and
+// sorts their groups into the buckets of the merge partitions
+static void aggregate_chunks( void *arg, int lo, int hi ){
+	group_job *job = (group_job *) arg;
+	group_table gt;
+	csv_record *rec;
+	group *g;
+	uint64_t hash;
+	int c, i, p, slot;
+	for( c = lo; c < hi; c++ ){
+		init_table( &gt );
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next ){
+			if( job->subset && !csv_set_member( rec->row, job->subset ) )
+				continue;
+			hash = hash_keys( job, rec );
+			slot = find_slot( job, &gt, hash, rec );
+			if( !(g = gt.slots[slot]) ){
+				g = (group *) calloc( 1, sizeof( group ) + job->naggs * sizeof( agg_state ) );
+				g->hash = hash;
+				g->first = rec;
+				insert_group( &gt, g );
+			}
+			accumulate( job, g, rec );
+		}
+		// Sort the groups into buckets
+		for( i = 0; i < gt.capacity; i++ ){
+			if( (g = gt.slots[i]) )
+				job->bcount[c * job->nchunks + merge_partition( job, g->hash )]++;
+		}
+		for( p = 0; p < job->nchunks; p++ ){
+			job->buckets[c * job->nchunks + p] = (group **) malloc( (job->bcount[c * job->nchunks + p] + 1) * sizeof( group * ) );
+			job->bcount[c * job->nchunks + p] = 0;
+		}
+		for( i = 0; i < gt.capacity; i++ ){
+			if( (g = gt.slots[i]) ){
+				p = c * job->nchunks + merge_partition( job, g->hash );
+				job->buckets[p][job->bcount[p]++] = g;
+			}
+		}
+		free( gt.slots );
+	}
+}
+
+// Merges the buckets of partitions lo through hi - 1 from every chunk
+static void merge_partitions( void *arg, int lo, int hi ){
+	group_job *job = (group_job *) arg;
+	group_table *gt;
+	group *g;
+	int c, i, p, b, slot;
+	for( p = lo; p < hi; p++ ){
+		gt = job->merged + p;
+		init_table( gt );
+		for( c = 0; c < job->nchunks; c++ ){
+			b = c * job->nchunks + p;
+			for( i = 0; i < job->bcount[b]; i++ ){
+				g = job->buckets[b][i];
+				slot = find_slot( job, gt, g->hash, g->first );
+				if( gt->slots[slot] ){
+					combine( job, gt->slots[slot], g );
+					free( g );
+				}
+				else
+					insert_group( gt, g );
+			}
+			free( job->buckets[b] );
+		}
+	}
+}
+
+// Orders groups by the row of their first record
+static int compare_groups( const void *a, const void *b ){
+	return (*(group **) a)->first->row - (*(group **) b)->first->row;
+}
+
+// Type of the result of an aggregate on a field of the given type:
+// sums and extremes keep the type of the field, averages and variances
+// of native fields are doubles, and counts are numbers
+static enum types result_type( enum aggregates function, enum types type ){
+	if( function == AGG_COUNT || type == csv_number )
+		return csv_number;
+	if( type == csv_int64 && function != AGG_AVG && function != AGG_VAR )
+		return csv_int64;
+	return csv_double;
+}
+
+// Computes the final value of an aggregate on an int64 field
+static int64_t finish_int64( enum aggregates function, agg_state *st ){
+	switch( function ){
+		case AGG_MIN :
+			return st->imin;
+		case AGG_MAX :
+			return st->imax;
+		default :
+			// A sum that overflowed 64 bits lost its last digits
+			if( st->sum.e > 0 )
+				return st->sum.m > 0 ? INT64_MAX : INT64_MIN;
+			return st->sum.m;
+	}
+}
+
+// Computes the final value of an aggregate on a native field as a
+// double
+static double finish_double( group *g, enum aggregates function, enum types type, agg_state *st ){
+	switch( function ){
+		case AGG_SUM :
+			return st->real;
+		case AGG_MIN :
+			return st->dmin;
+		case AGG_MAX :
+			return st->dmax;
+		case AGG_AVG :
+			return (type == csv_int64 ? csv_sum_to_double( &st->sum ) : st->real) / g->count;
+		default :
+			return g->count > 1 ? st->m2 / (g->count - 1) : 0;
+	}
+}
+
+// Computes the final value of an aggregate on a field of the given
+// type as a new cell of its result type
+static void *finish( group *g, enum aggregates function, enum types type, agg_state *st ){
+	dfloat64_t *out;
+	void *cell;
+	switch( result_type( function, type ) ){
+		case csv_int64 :
+			cell = malloc( sizeof( int64_t ) );
+			*(int64_t *) cell = finish_int64( function, st );
+			return cell;
+		case csv_double :
+			cell = malloc( sizeof( double ) );
+			*(double *) cell = finish_double( g, function, type, st );
+			return cell;
+		default :
+			break;
+	}
+	out = (dfloat64_t *) malloc( sizeof( dfloat64_t ) );
+	switch( function ){
+		case AGG_COUNT :
+			out->mantissa = g->count;
+			out->exponent = 0;
+			break;
+		case AGG_SUM :
+			csv_sum_to_dfloat( &st->sum, out );
+			break;
+		case AGG_MIN :
+			*out = st->min;
+			break;
+		case AGG_MAX :
+			*out = st->max;
+			break;
+		case AGG_AVG :
+			csv_double_to_dfloat( csv_sum_to_double( &st->sum ) / g->count, out );
+			break;
+		case AGG_VAR :
+			csv_double_to_dfloat( g->count > 1 ? st->m2 / (g->count - 1) : 0, out );
+			break;
+	}
+	return out;
+}
+
+// Names of the aggregate functions, used to name result fields
+static const char *aggregate_names[] = {
+	[AGG_COUNT] = "count",
+	[AGG_SUM] = "sum",
+	[AGG_MIN] = "min",
+	[AGG_MAX] = "max",
+	[AGG_AVG] = "avg",
+	[AGG_VAR] = "var"
+};
+
+// Equivalent to SELECT ... GROUP BY in SQL; returns a new table with
+// one record for each distinct combination of the nkeys fields named
+// in keys, holding those fields followed by the naggs aggregates in
+// aggs; returns NULL if a field does not exist or an aggregate other
+// than AGG_COUNT names a string field. Sums and extremes of int64 and
+// double fields keep their type, and averages and variances of them
+// are doubles.
+csv_table *csv_group_by( csv_table *table, int nkeys, char **keys, int naggs, csv_aggregate *aggs ){
+	return csv_group_by_subset( table, NULL, nkeys, keys, naggs, aggs );
+}
+
+// Same as csv_group_by(), but only aggregates the rows in subset
+csv_table *csv_group_by_subset( csv_table *table, csv_set *subset, int nkeys, char **keys, int naggs, csv_aggregate *aggs ){
+	group_job *job;
+	group **groups;
+	csv_field **fields;
+	csv_table *result;
+	csv_record *rec, *tail;
+	size_t len;
+	int i, j, f, p, n, rlen;
+	char *name;
+
+	job = (group_job *) calloc( 1, sizeof( group_job ) );
+	job->table = table;
+	job->subset = subset;
+	job->nkeys = nkeys;
+	job->naggs = naggs;
+	job->keys = (int *) malloc( (nkeys ? nkeys : 1) * sizeof( int ) );
+	job->fields = (int *) malloc( (naggs ? naggs : 1) * sizeof( int ) );
+	job->types = (enum types *) malloc( (naggs ? naggs : 1) * sizeof( enum types ) );
+	job->functions = (enum aggregates *) malloc( (naggs ? naggs : 1) * sizeof( enum aggregates ) );
+	for( i = 0; i < nkeys + naggs; i++ ){
+		name = i < nkeys ? keys[i] : aggs[i-nkeys].field;
+		if( i >= nkeys && aggs[i-nkeys].function == AGG_COUNT )
+			f = -1;
+		else{
+			for( f = 0; f < table->rlen; f++ ){
+				if( !strcmp( table->header[f]->name, name ) )
+					break;
+			}
+			if( f == table->rlen || (i >= nkeys && table->header[f]->type == csv_string) ){
+			// Error: Name not found or type mismatch
+				free( job->keys );
+				free( job->fields );
+				free( job->types );
+				free( job->functions );
+				free( job );
+				return NULL;
+			}
+		}
+		if( i < nkeys )
+			job->keys[i] = f;
+		else{
+			job->fields[i-nkeys] = f;
+			job->types[i-nkeys] = f < 0 ? csv_number : table->header[f]->type;
+			job->functions[i-nkeys] = aggs[i-nkeys].function;
+		}
+	}
+
+	// Aggregate each chunk, then merge the partial groups
+	job->nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	csv_parallel_for( job->nchunks, aggregate_chunks, job );
+	csv_parallel_for( job->nchunks, merge_partitions, job );
+
+	n = 0;
+	for( p = 0; p < job->nchunks; p++ )
+		n += job->merged[p].count;
+	groups = (group **) malloc( (n ? n : 1) * sizeof( group * ) );
+	n = 0;
+	for( p = 0; p < job->nchunks; p++ ){
+		for( i = 0; i < job->merged[p].capacity; i++ ){
+			if( job->merged[p].slots[i] )
+				groups[n++] = job->merged[p].slots[i];
+		}
+		free( job->merged[p].slots );
+	}
+	qsort( groups, n, sizeof( group * ), compare_groups );
+
+	// Build the result table: key fields followed by aggregates
+	rlen = nkeys + naggs;
+	fields = (csv_field **) malloc( rlen * sizeof( csv_field * ) );
+	for( i = 0; i < rlen; i++ ){
+		fields[i] = (csv_field *) malloc( sizeof( csv_field ) );
+		if( i < nkeys ){
+			len = strlen( table->header[job->keys[i]]->name ) + 1;
+			fields[i]->name = (char *) malloc( len );
+			memcpy( fields[i]->name, table->header[job->keys[i]]->name, len );
+			fields[i]->type = table->header[job->keys[i]]->type;
+			fields[i]->width = table->header[job->keys[i]]->width;
+			continue;
+		}
+		j = i - nkeys;
+		fields[i]->type = result_type( aggs[j].function, job->types[j] );
+		if( aggs[j].function == AGG_COUNT )
+			fields[i]->width = csv_integer32;
+		else
+			fields[i]->width = fields[i]->type == csv_int64 ? csv_integer64 : csv_dfloat64;
+		if( aggs[j].function == AGG_COUNT ){
+			fields[i]->name = (char *) malloc( strlen( aggregate_names[AGG_COUNT] ) + 1 );
+			strcpy( fields[i]->name, aggregate_names[AGG_COUNT] );
+		}
+		else{
+			len = strlen( aggregate_names[aggs[j].function] ) + strlen( aggs[j].field ) + 3;
+			fields[i]->name = (char *) malloc( len );
+			snprintf( fields[i]->name, len, "%s(%s)", aggregate_names[aggs[j].function], aggs[j].field );
+		}
+	}
+	// The result owns every name, so that it can be dropped on its own
+	result = csv_create_table( rlen, fields );
+	result->own_names = true;
+	for( i = 0; i < rlen; i++ )
+		free( fields[i] );
+	free( fields );
+
+	tail = result->start;
+	for( i = 0; i < n; i++ ){
+		rec = (csv_record *) calloc( 1, sizeof( csv_record ) );
+		rec->record = (void **) calloc( rlen, sizeof( void * ) );
+		rec->row = i;
+		for( j = 0; j < nkeys; j++ ){
+			f = job->keys[j];
+			rec->record[j] = csv_copy_cell( table->header[f]->type, groups[i]->first->record[f] );
+		}
+		for( j = 0; j < naggs; j++ )
+			rec->record[nkeys+j] = finish( groups[i], aggs[j].function, job->types[j], groups[i]->states + j );
+		tail->next = rec;
+		tail = rec;
+		csv_zone_add( result, rec );
+		free( groups[i] );
+	}
+	free( groups );
+	free( job->keys );
+	free( job->fields );
+	free( job->types );
+	free( job->functions );
+	free( job );
+	return result;
+}
+
+// Equivalent to SELECT DISTINCT in SQL; returns a set holding the
+// row of the first record of each distinct combination of the ncols
+// fields named in columns, or NULL if a field does not exist
+csv_set *csv_distinct( csv_table *table, int ncols, char **columns ){
+	group_job *job;
+	csv_set *subset;
+	group *g;
+	int i, f, p;
+
+	job = (group_job *) calloc( 1, sizeof( group_job ) );
+	job->table = table;
+	job->nkeys = ncols;
+	job->keys = (int *) malloc( (ncols ? ncols : 1) * sizeof( int ) );
+	for( i = 0; i < ncols; i++ ){
+		for( f = 0; f < table->rlen; f++ ){
+			if( !strcmp( table->header[f]->name, columns[i] ) )
+				break;
+		}
+		if( f == table->rlen ){
+		// Error: Name not found
+			free( job->keys );
+			free( job );
+			return NULL;
+		}
+		job->keys[i] = f;
+	}
+
+	// Group the records without aggregates; each group keeps its
+	// earliest record
+	job->nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	csv_parallel_for( job->nchunks, aggregate_chunks, job );
+	csv_parallel_for( job->nchunks, merge_partitions, job );
+
+	subset = csv_empty_set( table->zcount ? csv_zone_rows( table ) : csv_count_records( table ) );
+	for( p = 0; p < job->nchunks; p++ ){
+		for( i = 0; i < job->merged[p].capacity; i++ ){
+			if( (g = job->merged[p].slots[i]) ){
+				csv_set_add( subset, g->first->row );
+				free( g );
+			}
+		}
+		free( job->merged[p].slots );
+	}
+	free( job->keys );
+	free( job );
+	return subset;
+}
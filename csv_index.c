@@ -0,0 +1,456 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Secondary indexes on CSV   *
+ *                 tables                     *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+
+/*
+ * An index on a number, int64 or double field is an array of
+ * pointers to the records of the table sorted by the value of the
+ * field, with ties broken by row number and NaNs at the end. Range
+ * conditions on the field can then be answered with two binary
+ * searches.
+ *
+ * An index on a string field is an open-addressing hash table of
+ * pointers to the records, probed linearly and kept at most half
+ * full. The hash of each entry's value is stored next to it so
+ * that probes only call strcmp() on likely matches. Records with
+ * equal values all live in the same probe sequence.
+ *
+ * The table functions that insert, delete or modify records call
+ * csv_index_add() and csv_index_remove() to keep every index on the
+ * table up to date.
+ */
+
+// Hashes a sequence of bytes, eight bytes at a time
+uint64_t csv_hash_bytes( const void *src, size_t len ){
+	const uint8_t *ptr;
+	uint64_t h, k;
+	ptr = (const uint8_t *) src;
+	h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL);
+	while( len >= 8 ){
+		memcpy( &k, ptr, 8 );
+		k *= 0x87c37b91114253d5ULL;
+		k = (k << 31) | (k >> 33);
+		h = (h ^ k) * 0x4cf5ad432745937fULL;
+		h = (h << 27) | (h >> 37);
+		ptr += 8;
+		len -= 8;
+	}
+	k = 0;
+	while( len > 0 )
+		k = (k << 8) | ptr[--len];
+	h ^= k * 0x87c37b91114253d5ULL;
+	// Final avalanche so that the low bits depend on every input bit
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Hash of a string field value
+#define hash_string( str ) csv_hash_bytes( (str), strlen( str ) )
+
+// Hashes the value of a field so that equal values hash equally;
+// numbers are reduced to their shortest mantissa first, since
+// 1.50 and 1.5 are stored differently
+uint64_t csv_hash_cell( csv_table *table, int f, void *cell ){
+	int64_t key[2];
+	int32_t m, e;
+	double d;
+	if( table->header[f]->type == csv_string )
+		return hash_string( (char *) cell );
+	if( table->header[f]->type == csv_int64 )
+		return csv_hash_bytes( cell, sizeof( int64_t ) );
+	if( table->header[f]->type == csv_double ){
+		// -0.0 equals 0.0 but has other bits, and every NaN
+		// equals every other one
+		d = *(double *) cell;
+		if( d == 0 )
+			d = 0;
+		else if( d != d )
+			d = NAN;
+		return csv_hash_bytes( &d, sizeof( double ) );
+	}
+	m = ((dfloat64_t *) cell)->mantissa;
+	e = ((dfloat64_t *) cell)->exponent;
+	if( m == 0 )
+		e = 0;
+	else while( m % 10 == 0 ){
+		m /= 10;
+		e++;
+	}
+	key[0] = m;
+	key[1] = e;
+	return csv_hash_bytes( key, sizeof( key ) );
+}
+
+// Compares the key (value, row) of an indexed record with the
+// key (value, row)
+static int compare_key( csv_index *index, csv_record *rec, void *value, int row ){
+	int c;
+	c = csv_compare_cells( index->type, rec->record[index->field], value );
+	if( c )
+		return c;
+	return (rec->row > row) - (rec->row < row);
+}
+
+// Returns the position of the first entry in the index whose key
+// is not less than (value, row)
+static int search( csv_index *index, void *value, int row ){
+	int lo, hi, mid;
+	lo = 0;
+	hi = index->count;
+	while( lo < hi ){
+		mid = lo + (hi - lo) / 2;
+		if( compare_key( index, index->records[mid], value, row ) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Position of the first record whose value is not less than value
+int csv_index_lower_bound( csv_index *index, void *value ){
+	return search( index, value, INT_MIN );
+}
+
+// Position of the first record whose value is greater than value
+int csv_index_upper_bound( csv_index *index, void *value ){
+	return search( index, value, INT_MAX );
+}
+
+// Stable merge sort of records by the value of a field
+static void sort_records( csv_record **records, int n, int field, enum types type ){
+	csv_record **src, **dst, **tmp;
+	int width, lo, mid, hi, i, j, k;
+	src = records;
+	dst = (csv_record **) malloc( (n ? n : 1) * sizeof( csv_record * ) );
+	for( width = 1; width < n; width <<= 1 ){
+		for( lo = 0; lo < n; lo += width << 1 ){
+			mid = lo + width < n ? lo + width : n;
+			hi = lo + (width << 1) < n ? lo + (width << 1) : n;
+			i = lo;
+			j = mid;
+			k = lo;
+			while( i < mid && j < hi ){
+				if( csv_compare_cells( type, src[j]->record[field], src[i]->record[field] ) < 0 )
+					dst[k++] = src[j++];
+				else
+					dst[k++] = src[i++];
+			}
+			while( i < mid )
+				dst[k++] = src[i++];
+			while( j < hi )
+				dst[k++] = src[j++];
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if( src != records ){
+		memcpy( records, src, n * sizeof( csv_record * ) );
+		free( src );
+	}
+	else
+		free( dst );
+}
+
+// Stores a record in a hash index that has room for it
+static void hash_insert( csv_index *index, csv_record *rec, uint64_t hash ){
+	int mask, slot;
+	mask = index->capacity - 1;
+	for( slot = hash & mask; index->records[slot]; slot = (slot + 1) & mask );
+	index->records[slot] = rec;
+	index->hashes[slot] = hash;
+	index->count++;
+}
+
+// Allocates the slots of a hash index and fills them with the
+// given records
+static void hash_build( csv_index *index, csv_record **records, int n, int capacity ){
+	int i;
+	index->capacity = capacity;
+	index->count = 0;
+	index->records = (csv_record **) calloc( capacity, sizeof( csv_record * ) );
+	index->hashes = (uint64_t *) malloc( capacity * sizeof( uint64_t ) );
+	for( i = 0; i < n; i++ )
+		hash_insert( index, records[i], hash_string( (char *) records[i]->record[index->field] ) );
+}
+
+// Doubles the number of slots in a hash index
+static void hash_grow( csv_index *index ){
+	csv_record **old;
+	int i, n, capacity;
+	old = index->records;
+	capacity = index->capacity;
+	n = 0;
+	// Compact the existing entries to the front of the old array
+	for( i = 0; i < capacity; i++ ){
+		if( old[i] )
+			old[n++] = old[i];
+	}
+	free( index->hashes );
+	hash_build( index, old, n, capacity << 1 );
+	free( old );
+}
+
+// Removes a record from a hash index, shifting later entries of
+// the probe sequence back so that no tombstones are needed
+static void hash_delete( csv_index *index, csv_record *rec, uint64_t hash ){
+	int mask, slot, next, home;
+	mask = index->capacity - 1;
+	for( slot = hash & mask; index->records[slot] != rec; slot = (slot + 1) & mask ){
+		if( !index->records[slot] )
+		// Record is not in the index
+			return;
+	}
+	next = slot;
+	for( ;; ){
+		index->records[slot] = NULL;
+		// Find the next entry that may move into the empty slot
+		for( ;; ){
+			next = (next + 1) & mask;
+			if( !index->records[next] ){
+				index->count--;
+				return;
+			}
+			home = index->hashes[next] & mask;
+			// The entry can move unless its home slot lies
+			// cyclically in (slot, next]
+			if( slot <= next ? (home <= slot || home > next) : (home <= slot && home > next) )
+				break;
+		}
+		index->records[slot] = index->records[next];
+		index->hashes[slot] = index->hashes[next];
+		slot = next;
+	}
+}
+
+// Starts a lookup of the records whose field equals value
+void csv_index_open( csv_index *index, char *value, index_cursor *cursor ){
+	cursor->hash = hash_string( value );
+	cursor->slot = cursor->hash & (index->capacity - 1);
+}
+
+// Returns the next record of a lookup started by csv_index_open(),
+// or NULL once every match has been returned; matches are not
+// returned in row order
+csv_record *csv_index_match( csv_index *index, char *value, index_cursor *cursor ){
+	csv_record *rec;
+	int mask;
+	mask = index->capacity - 1;
+	while( (rec = index->records[cursor->slot]) ){
+		cursor->slot = (cursor->slot + 1) & mask;
+		if( index->hashes[(cursor->slot - 1) & mask] == cursor->hash && !strcmp( (char *) rec->record[index->field], value ) )
+			return rec;
+	}
+	return NULL;
+}
+
+// Returns the index on the given field, or NULL if there is none
+csv_index *csv_find_index( csv_table *table, int field ){
+	csv_index *index;
+	for( index = table->indexes; index; index = index->next ){
+		if( index->field == field )
+			return index;
+	}
+	return NULL;
+}
+
+// Equivalent to CREATE INDEX in SQL, creating a sorted index on a
+// number, int64 or double field or a hash index on a string field;
+// returns the new
+// index, or the existing one if the field is already indexed
+csv_index *csv_create_index( csv_table *table, char *name ){
+	csv_index *index;
+	csv_record *rec;
+	csv_record **records;
+	int f, n, capacity;
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, name ) )
+			break;
+	}
+	if( f == table->rlen )
+	// Error: Name not found
+		return NULL;
+	if( (index = csv_find_index( table, f )) )
+		return index;
+
+	index = (csv_index *) calloc( 1, sizeof( csv_index ) );
+	index->field = f;
+	index->type = table->header[f]->type;
+	index->count = csv_count_records( table );
+	index->capacity = index->count > 16 ? index->count : 16;
+	index->records = (csv_record **) malloc( index->capacity * sizeof( csv_record * ) );
+	n = 0;
+	for( rec = table->start->next; rec; rec = rec->next )
+		index->records[n++] = rec;
+	if( table->header[f]->type == csv_string ){
+		// Hash index with at least twice as many slots as records
+		index->hashed = true;
+		for( capacity = 16; capacity < 2 * n; capacity <<= 1 );
+		records = index->records;
+		hash_build( index, records, n, capacity );
+		free( records );
+	}
+	else{
+		// Records start out in row order, so a stable sort by value
+		// leaves ties ordered by row
+		sort_records( index->records, n, f, index->type );
+	}
+
+	index->next = table->indexes;
+	table->indexes = index;
+	return index;
+}
+
+// Frees an index
+static void free_index( csv_index *index ){
+	free( index->records );
+	free( index->hashes );
+	free( index );
+}
+
+// Equivalent to DROP INDEX in SQL
+void csv_drop_index( csv_table *table, char *name ){
+	csv_index **link;
+	csv_index *index;
+	for( link = &table->indexes; *link; link = &(*link)->next ){
+		if( !strcmp( table->header[(*link)->field]->name, name ) ){
+			index = *link;
+			*link = index->next;
+			free_index( index );
+			return;
+		}
+	}
+}
+
+// Frees every index on a table
+void csv_drop_indexes( csv_table *table ){
+	csv_index *index;
+	while( table->indexes ){
+		index = table->indexes;
+		table->indexes = index->next;
+		free_index( index );
+	}
+}
+
+// Adds a record to the indexes on the given field, or to every
+// index on the table if field is ALL_FIELDS
+void csv_index_add( csv_table *table, csv_record *rec, int field ){
+	csv_index *index;
+	int pos;
+	for( index = table->indexes; index; index = index->next ){
+		if( field != ALL_FIELDS && index->field != field )
+			continue;
+		if( index->hashed ){
+			if( 2 * (index->count + 1) > index->capacity )
+				hash_grow( index );
+			hash_insert( index, rec, hash_string( (char *) rec->record[index->field] ) );
+			continue;
+		}
+		if( index->count == index->capacity ){
+			index->capacity <<= 1;
+			index->records = (csv_record **) realloc( index->records, index->capacity * sizeof( csv_record * ) );
+		}
+		pos = search( index, rec->record[index->field], rec->row );
+		memmove( index->records + pos + 1, index->records + pos, (index->count - pos) * sizeof( csv_record * ) );
+		index->records[pos] = rec;
+		index->count++;
+	}
+}
+
+// Removes a record from the indexes on the given field, or from
+// every index on the table if field is ALL_FIELDS; must be called
+// before the indexed value changes
+void csv_index_remove( csv_table *table, csv_record *rec, int field ){
+	csv_index *index;
+	int pos;
+	for( index = table->indexes; index; index = index->next ){
+		if( field != ALL_FIELDS && index->field != field )
+			continue;
+		if( index->hashed ){
+			hash_delete( index, rec, hash_string( (char *) rec->record[index->field] ) );
+			continue;
+		}
+		pos = search( index, rec->record[index->field], rec->row );
+		if( pos == index->count || index->records[pos] != rec )
+		// Record is not in the index
+			continue;
+		memmove( index->records + pos, index->records + pos + 1, (index->count - pos - 1) * sizeof( csv_record * ) );
+		index->count--;
+	}
+}
+
+// Moves the Current Record Pointer to the first record whose field
+// given by name equals value and returns it; returns NULL and leaves
+// the Current Record Pointer alone if there is no such record
+csv_record *csv_find_record( csv_table *table, char *name, char *value ){
+	index_cursor cursor;
+	csv_index *index;
+	csv_record *rec;
+	csv_record *found;
+	void *cell;
+	int f, pos;
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, name ) )
+			break;
+	}
+	if( f == table->rlen )
+	// Error: Name not found
+		return NULL;
+	index = csv_find_index( table, f );
+	found = NULL;
+	if( table->header[f]->type == csv_string ){
+		if( index ){
+			// Hash lookup; matches come out of order, keep the first row
+			csv_index_open( index, value, &cursor );
+			while( (rec = csv_index_match( index, value, &cursor )) ){
+				if( !found || rec->row < found->row )
+					found = rec;
+			}
+		}
+		else{
+			for( rec = table->start->next; rec && !found; rec = rec->next ){
+				if( !strcmp( (char *) rec->record[f], value ) )
+					found = rec;
+			}
+		}
+	}
+	else{
+		cell = csv_parse_cell( table->header[f]->type, value );
+		if( index ){
+			// Ties are ordered by row, so the lower bound is the first row
+			pos = csv_index_lower_bound( index, cell );
+			if( pos < index->count && !csv_compare_cells( index->type, index->records[pos]->record[f], cell ) )
+				found = index->records[pos];
+		}
+		else{
+			for( rec = table->start->next; rec && !found; rec = rec->next ){
+				if( !csv_compare_cells( table->header[f]->type, rec->record[f], cell ) )
+					found = rec;
+			}
+		}
+		free( cell );
+	}
+	if( found )
+		table->cur = found;
+	return found;
+}
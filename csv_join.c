@@ -0,0 +1,217 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Implementation of SQL      *
+ *                 JOIN clause                *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
+
+/*
+ * Joins build a hash table on the key of one table and probe it
+ * with the records of the other, one chunk of zones per thread.
+ * Each chunk links its output records into a chain of its own and
+ * the chains are joined in chunk order, so the output follows the
+ * order of the probing table, and matches for the same record
+ * follow the order of the other table.
+ *
+ * The result is a view: its records point to the cells of the two
+ * tables instead of copies, so it must be dropped before them and
+ * cannot be modified.
+ */
+
+// Cells of the right table in a left join when no record matches
+static dfloat64_t null_number = { 0, 0 };
+static char null_string[] = "";
+static int64_t null_int64 = 0;
+static double null_double = 0;
+
+// Hash table of the records of the building table; records with
+// equal keys are found in the order they were added
+typedef struct {
+	csv_record **slots;
+	uint64_t *hashes;
+	int capacity;
+} join_table;
+
+// State shared by the workers of a join
+typedef struct {
+	csv_table *left;
+	csv_table *right;
+	csv_table *probe;                   // Table whose records probe ht
+	int lkey;                           // Key field of each table
+	int rkey;
+	enum joins type;
+	join_table ht;
+	int nchunks;
+	csv_record *first[CSV_MAX_THREADS]; // First record of each chunk
+	int count[CSV_MAX_THREADS];         // # of records in each chunk
+	csv_record *heads[CSV_MAX_THREADS]; // Output chain of each chunk
+	csv_record *tails[CSV_MAX_THREADS];
+} join_job;
+
+// Returns true if the keys of two records are equal
+static bool same_key( join_job *job, csv_record *l, csv_record *r ){
+	return !csv_compare_cells( job->left->header[job->lkey]->type, l->record[job->lkey], r->record[job->rkey] );
+}
+
+// Adds the records of a table to a hash table with at least twice
+// as many slots as records
+static void build_table( join_table *ht, csv_table *table, int f ){
+	csv_record *rec;
+	uint64_t hash;
+	int n, slot;
+	n = csv_count_records( table );
+	for( ht->capacity = 16; ht->capacity < 2 * n; ht->capacity <<= 1 );
+	ht->slots = (csv_record **) calloc( ht->capacity, sizeof( csv_record * ) );
+	ht->hashes = (uint64_t *) malloc( ht->capacity * sizeof( uint64_t ) );
+	for( rec = table->start->next; rec; rec = rec->next ){
+		hash = csv_hash_cell( table, f, rec->record[f] );
+		slot = (int) (hash & (ht->capacity - 1));
+		while( ht->slots[slot] )
+			slot = (slot + 1) & (ht->capacity - 1);
+		ht->slots[slot] = rec;
+		ht->hashes[slot] = hash;
+	}
+}
+
+// Appends a record combining a left and a right record, or the null
+// cells if r is NULL, to the output chain of a chunk
+static void emit( join_job *job, int c, csv_record *l, csv_record *r ){
+	csv_record *rec;
+	int f, rlen;
+	rlen = job->left->rlen;
+	rec = (csv_record *) calloc( 1, sizeof( csv_record ) );
+	rec->record = (void **) malloc( (rlen + job->right->rlen) * sizeof( void * ) );
+	memcpy( rec->record, l->record, rlen * sizeof( void * ) );
+	if( r )
+		memcpy( rec->record + rlen, r->record, job->right->rlen * sizeof( void * ) );
+	else for( f = 0; f < job->right->rlen; f++ ){
+		if( job->right->header[f]->type == csv_number )
+			rec->record[rlen+f] = &null_number;
+		else if( job->right->header[f]->type == csv_int64 )
+			rec->record[rlen+f] = &null_int64;
+		else if( job->right->header[f]->type == csv_double )
+			rec->record[rlen+f] = &null_double;
+		else
+			rec->record[rlen+f] = null_string;
+	}
+	if( job->tails[c] )
+		job->tails[c]->next = rec;
+	else
+		job->heads[c] = rec;
+	job->tails[c] = rec;
+}
+
+// Probes the hash table with the records of chunks lo through hi - 1
+static void probe_chunks( void *arg, int lo, int hi ){
+	join_job *job = (join_job *) arg;
+	csv_record *rec, *match;
+	uint64_t hash;
+	bool left, matched;
+	int c, i, pkey, slot;
+	left = job->probe == job->left;
+	pkey = left ? job->lkey : job->rkey;
+	for( c = lo; c < hi; c++ ){
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next ){
+			hash = csv_hash_cell( job->probe, pkey, rec->record[pkey] );
+			slot = (int) (hash & (job->ht.capacity - 1));
+			matched = false;
+			for( ; (match = job->ht.slots[slot]); slot = (slot + 1) & (job->ht.capacity - 1) ){
+				if( job->ht.hashes[slot] != hash )
+					continue;
+				if( left && same_key( job, rec, match ) )
+					emit( job, c, rec, match );
+				else if( !left && same_key( job, match, rec ) )
+					emit( job, c, match, rec );
+				else
+					continue;
+				matched = true;
+			}
+			if( !matched && job->type == LEFT_JOIN )
+				emit( job, c, rec, NULL );
+		}
+	}
+}
+
+// Equivalent to SELECT * FROM left JOIN right ON left_key = right_key
+// in SQL; returns a view holding the fields of left followed by those
+// of right for each pair of records with equal keys, or NULL if a key
+// does not exist or the keys have different types
+//
+// INNER_JOIN keeps only the pairs; LEFT_JOIN also keeps every record
+// of left without a match, with 0 and "" in the fields of right. The
+// hash table is built on the smaller table for an inner join and on
+// right for a left join, and the output follows the order of the
+// other table.
+csv_table *csv_join( csv_table *left, csv_table *right, char *left_key, char *right_key, enum joins type ){
+	join_job *job;
+	csv_field **fields;
+	csv_table *result, *build;
+	csv_record *tail, *rec;
+	int f, c, row, rlen;
+
+	job = (join_job *) calloc( 1, sizeof( join_job ) );
+	job->left = left;
+	job->right = right;
+	job->type = type;
+	for( job->lkey = 0; job->lkey < left->rlen; job->lkey++ ){
+		if( !strcmp( left->header[job->lkey]->name, left_key ) )
+			break;
+	}
+	for( job->rkey = 0; job->rkey < right->rlen; job->rkey++ ){
+		if( !strcmp( right->header[job->rkey]->name, right_key ) )
+			break;
+	}
+	if( job->lkey == left->rlen || job->rkey == right->rlen ||
+	    left->header[job->lkey]->type != right->header[job->rkey]->type ){
+	// Error: Name not found or type mismatch
+		free( job );
+		return NULL;
+	}
+
+	// Build on the smaller side unless every left record is needed
+	build = right;
+	if( type == INNER_JOIN && csv_count_records( left ) < csv_count_records( right ) )
+		build = left;
+	job->probe = build == right ? left : right;
+	build_table( &job->ht, build, build == right ? job->rkey : job->lkey );
+	job->nchunks = csv_zone_chunks( job->probe, CSV_MAX_THREADS, job->first, job->count );
+	csv_parallel_for( job->nchunks, probe_chunks, job );
+	free( job->ht.slots );
+	free( job->ht.hashes );
+
+	rlen = left->rlen + right->rlen;
+	fields = (csv_field **) malloc( rlen * sizeof( csv_field * ) );
+	for( f = 0; f < rlen; f++ )
+		fields[f] = f < left->rlen ? left->header[f] : right->header[f-left->rlen];
+	result = csv_create_table( rlen, fields );
+	free( fields );
+	result->view = true;
+
+	// Link the chains of the chunks together
+	tail = result->start;
+	for( c = 0; c < job->nchunks; c++ ){
+		if( job->heads[c] ){
+			tail->next = job->heads[c];
+			tail = job->tails[c];
+		}
+	}
+	row = 0;
+	for( rec = result->start->next; rec; rec = rec->next ){
+		rec->row = row++;
+		csv_zone_add( result, rec );
+	}
+	free( job );
+	return result;
+}
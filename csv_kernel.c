@@ -0,0 +1,488 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Block comparison kernels   *
+ *                 used by row selection      *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+
+#ifdef _CSV_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+/*
+ * The kernels in this module compare a block of numbers with a
+ * constant. The numbers are first scaled to the smallest exponent
+ * in the block so that the comparison becomes a plain integer
+ * comparison. Every loop is free of data-dependent branches and
+ * works on contiguous arrays so that the compiler can turn it into
+ * SIMD instructions; half-selective conditions no longer pay for
+ * a mispredicted branch on every other record.
+ */
+
+// Bit masks of the dfloat64_cmp() results (-1, 0, 1, shifted
+// up by one) that satisfy each numerical comparison operator
+const int csv_cmp_masks[] = {
+	[EQ] = 0x2,
+	[NE] = 0x5,
+	[LT] = 0x1,
+	[GT] = 0x4,
+	[LE] = 0x3,
+	[GE] = 0x6
+};
+
+// Powers of ten used to scale mantissas
+const int64_t csv_pow10[] = {
+	1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL,
+	10000000LL, 100000000LL, 1000000000LL
+};
+
+// Scales the n numbers pointed to by cells and the constant k to a
+// common exponent and stores the resulting integers in out and kout;
+// returns false if the exponents are too far apart to do so exactly
+bool csv_normalize_block( dfloat64_t **cells, int n, dfloat64_t *k, int64_t *out, int64_t *kout ){
+	int32_t mantissa[KERNEL_BLOCK];
+	int32_t exponent[KERNEL_BLOCK];
+	int32_t emin, emax, e;
+	int i;
+
+	// Gather the cells into contiguous arrays
+	for( i = 0; i < n; i++ ){
+		mantissa[i] = cells[i]->mantissa;
+		exponent[i] = cells[i]->exponent;
+	}
+
+	// Find the exponent range, ignoring zeros, whose exponent
+	// is meaningless
+	emin = k->mantissa ? k->exponent : INT32_MAX;
+	emax = k->mantissa ? k->exponent : INT32_MIN;
+	for( i = 0; i < n; i++ ){
+		e = mantissa[i] ? exponent[i] : INT32_MAX;
+		emin = e < emin ? e : emin;
+		e = mantissa[i] ? exponent[i] : INT32_MIN;
+		emax = e > emax ? e : emax;
+	}
+	if( emin == INT32_MAX )
+	// Every value is zero
+		emin = emax = 0;
+	if( (int64_t) emax - emin > KERNEL_MAX_SCALE )
+		return false;
+
+	for( i = 0; i < n; i++ )
+		out[i] = (int64_t) mantissa[i] * csv_pow10[mantissa[i] ? exponent[i] - emin : 0];
+	*kout = (int64_t) k->mantissa * csv_pow10[k->mantissa ? k->exponent - emin : 0];
+	return true;
+}
+
+// Compares n normalized values with the normalized constant k,
+// storing 1 in out for each value that satisfies the operator
+// and 0 for each one that doesn't
+void csv_compare_block( int64_t *values, int n, int64_t k, enum operators operator, uint8_t *out ){
+	int i;
+	switch( operator ){
+		case EQ : for( i = 0; i < n; i++ ) out[i] = values[i] == k; break;
+		case NE : for( i = 0; i < n; i++ ) out[i] = values[i] != k; break;
+		case LT : for( i = 0; i < n; i++ ) out[i] = values[i] < k; break;
+		case GT : for( i = 0; i < n; i++ ) out[i] = values[i] > k; break;
+		case LE : for( i = 0; i < n; i++ ) out[i] = values[i] <= k; break;
+		case GE : for( i = 0; i < n; i++ ) out[i] = values[i] >= k; break;
+		default : memset( out, 0, n ); break;
+	}
+}
+
+// Compares a block of doubles with the constant k
+void csv_compare_block_double( double *values, int n, double k, enum operators operator, uint8_t *out ){
+	int i;
+	switch( operator ){
+		case EQ : for( i = 0; i < n; i++ ) out[i] = values[i] == k; break;
+		case NE : for( i = 0; i < n; i++ ) out[i] = values[i] != k; break;
+		case LT : for( i = 0; i < n; i++ ) out[i] = values[i] < k; break;
+		case GT : for( i = 0; i < n; i++ ) out[i] = values[i] > k; break;
+		case LE : for( i = 0; i < n; i++ ) out[i] = values[i] <= k; break;
+		case GE : for( i = 0; i < n; i++ ) out[i] = values[i] >= k; break;
+		default : memset( out, 0, n ); break;
+	}
+}
+
+// Fallback for blocks that cannot be normalized: compares each
+// value with dfloat64_cmp()
+void csv_compare_block_slow( dfloat64_t **cells, int n, dfloat64_t *k, enum operators operator, uint8_t *out ){
+	int i, mask;
+	mask = csv_cmp_masks[operator];
+	for( i = 0; i < n; i++ )
+		out[i] = (mask >> (dfloat64_cmp( cells[i], k ) + 1)) & 1;
+}
+
+// Compares a block of cells of the int64 or double field of a
+// prepared predicate with its operand
+void csv_compare_natives( csv_predicate *pred, void *values, int n, uint8_t *out ){
+	if( pred->type == csv_double )
+		csv_compare_block_double( (double *) values, n, pred->real, pred->operator, out );
+	else if( pred->whole || (pred->operator != EQ && pred->operator != NE && pred->real == pred->real) )
+		csv_compare_block( (int64_t *) values, n, pred->integer, pred->operator, out );
+	else
+	// A fraction never equals an integer, and NaN equals nothing
+		memset( out, pred->operator == NE, n );
+}
+
+// Sets the operand of a comparison on an int64 field from a real
+// number; one that is not an integer is rounded in the direction
+// that keeps the outcome of LT, LE, GT and GE, and makes EQ and NE
+// constant, and NaN makes every comparison but NE fail
+void csv_integer_operand( csv_predicate *pred, double real ){
+	pred->real = real;
+	pred->whole = false;
+	if( real != real )
+		pred->integer = 0;
+	else if( real >= 9223372036854775807.0 )
+		pred->integer = INT64_MAX;
+	else if( real < -9223372036854775808.0 )
+		pred->integer = INT64_MIN;
+	else{
+		pred->integer = (int64_t) real;
+		pred->whole = (double) pred->integer == real;
+		// Round toward -infinity for LE and GT, toward +infinity for
+		// LT and GE
+		if( (pred->operator == LE || pred->operator == GT) && (double) pred->integer > real )
+			pred->integer--;
+		else if( (pred->operator == LT || pred->operator == GE) && (double) pred->integer < real )
+			pred->integer++;
+	}
+}
+
+// Packs n truth values into bits, eight to a byte, starting
+// with the least significant bit of bits[0]
+void csv_pack_bits( uint8_t *truth, int n, uint8_t *bits ){
+	int i, b;
+	uint8_t byte;
+	for( i = 0; i + 8 <= n; i += 8 ){
+		bits[i >> 3] = truth[i] | (truth[i+1] << 1) | (truth[i+2] << 2) | (truth[i+3] << 3)
+		             | (truth[i+4] << 4) | (truth[i+5] << 5) | (truth[i+6] << 6) | (truth[i+7] << 7);
+	}
+	if( i < n ){
+		byte = 0;
+		for( b = 0; i + b < n; b++ )
+			byte |= truth[i+b] << b;
+		bits[i >> 3] = byte;
+	}
+}
+
+// Sets the first n bits of bits
+void csv_fill_bits( uint8_t *bits, int n ){
+	memset( bits, 0xff, n >> 3 );
+	if( n & 7 )
+		bits[n >> 3] = (1 << (n & 7)) - 1;
+}
+
+// Number of threads used by csv_parallel_for(), 0 until it has
+// been set or detected
+static int csv_threads = 0;
+
+// Sets the number of threads used to evaluate selections; has no
+// effect unless libcsv was built with _CSV_THREADS
+void csv_set_threads( int n ){
+	csv_threads = n < 1 ? 1 : n > CSV_MAX_THREADS ? CSV_MAX_THREADS : n;
+}
+
+#ifdef _CSV_THREADS
+// Range of work items handed to one thread
+typedef struct {
+	void (*fn)( void *, int, int );
+	void *arg;
+	int lo, hi;
+} parallel_range;
+
+static void *run_range( void *p ){
+	parallel_range *range = (parallel_range *) p;
+	range->fn( range->arg, range->lo, range->hi );
+	return NULL;
+}
+#endif
+
+// Calls fn( arg, lo, hi ) on disjoint ranges of work items covering
+// [0, n), one range per thread; fn must only write data belonging
+// to its own range. Without _CSV_THREADS, fn is called once on the
+// whole range.
+void csv_parallel_for( int n, void (*fn)( void *, int, int ), void *arg ){
+#ifdef _CSV_THREADS
+	pthread_t threads[CSV_MAX_THREADS];
+	parallel_range ranges[CSV_MAX_THREADS];
+	bool started[CSV_MAX_THREADS];
+	long ncpu;
+	int t, nt;
+	if( !csv_threads ){
+		ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+		csv_set_threads( ncpu > 0 ? (int) ncpu : 1 );
+	}
+	nt = n < csv_threads ? n : csv_threads;
+	if( nt > 1 ){
+		for( t = 0; t < nt; t++ ){
+			ranges[t].fn = fn;
+			ranges[t].arg = arg;
+			ranges[t].lo = (int) ((int64_t) n * t / nt);
+			ranges[t].hi = (int) ((int64_t) n * (t + 1) / nt);
+		}
+		for( t = 1; t < nt; t++ )
+			started[t] = !pthread_create( threads + t, NULL, run_range, ranges + t );
+		// The calling thread takes the first range and any range
+		// whose thread could not be started
+		run_range( ranges );
+		for( t = 1; t < nt; t++ ){
+			if( started[t] )
+				pthread_join( threads[t], NULL );
+			else
+				run_range( ranges + t );
+		}
+		return;
+	}
+#endif
+	if( n > 0 )
+		fn( arg, 0, n );
+}
+
+// Adds m * 10^e to a sum; the sum stays exact as long as both fit in
+// 64 bits at the smaller exponent, otherwise the least significant
+// digits are dropped
+void csv_sum_add( csv_sum *sum, int64_t m, int32_t e ){
+	if( !m )
+		return;
+	if( !sum->m ){
+		sum->m = m;
+		sum->e = e;
+		return;
+	}
+	// Bring both terms to the same exponent, scaling up where
+	// possible and dropping digits where not
+	while( sum->e > e && sum->m <= INT64_MAX / 10 && sum->m >= -(INT64_MAX / 10) ){
+		sum->m *= 10;
+		sum->e--;
+	}
+	while( e > sum->e && m <= INT64_MAX / 10 && m >= -(INT64_MAX / 10) ){
+		m *= 10;
+		e--;
+	}
+	while( sum->e < e && sum->m ){
+		sum->m /= 10;
+		sum->e++;
+	}
+	while( e < sum->e && m ){
+		m /= 10;
+		e++;
+	}
+	if( !sum->m ){
+		sum->m = m;
+		sum->e = e;
+		return;
+	}
+	if( (m > 0 && sum->m > INT64_MAX - m) || (m < 0 && sum->m < INT64_MIN - m) ){
+		sum->m /= 10;
+		m /= 10;
+		sum->e++;
+	}
+	sum->m += m;
+}
+
+// Rounds a sum to the 32-bit mantissa of a dfloat64_t
+void csv_sum_to_dfloat( csv_sum *sum, dfloat64_t *out ){
+	int64_t m;
+	int32_t e;
+	m = sum->m;
+	e = sum->e;
+	while( m > INT32_MAX || m < -INT32_MAX ){
+		m = (m + (m > 0 ? 5 : -5)) / 10;
+		e++;
+	}
+	out->mantissa = (int32_t) m;
+	out->exponent = m ? e : 0;
+}
+
+// Converts m * 10^e to double precision
+static double scale_double( double x, int32_t e ){
+	for( ; e > 0; e-- )
+		x *= 10;
+	for( ; e < 0; e++ )
+		x /= 10;
+	return x;
+}
+
+// Converts a sum to double precision
+double csv_sum_to_double( csv_sum *sum ){
+	return scale_double( (double) sum->m, sum->e );
+}
+
+// Converts a number to double precision
+double csv_dfloat_to_double( dfloat64_t *val ){
+	return scale_double( (double) val->mantissa, val->exponent );
+}
+
+// Converts a double to a number with nine significant digits
+void csv_double_to_dfloat( double x, dfloat64_t *out ){
+	int64_t m;
+	int32_t e;
+	bool neg;
+	out->mantissa = 0;
+	out->exponent = 0;
+	// Zero, infinities and NaN all come out as zero
+	if( x == 0 || x - x != 0 )
+		return;
+	neg = x < 0;
+	if( neg )
+		x = -x;
+	e = 0;
+	while( x >= 1e9 ){
+		x /= 10;
+		e++;
+	}
+	while( x < 1e8 ){
+		x *= 10;
+		e--;
+	}
+	m = (int64_t) (x + 0.5);
+	while( m % 10 == 0 ){
+		m /= 10;
+		e++;
+	}
+	out->mantissa = (int32_t) (neg ? -m : m);
+	out->exponent = e;
+}
+
+// Parses the text of a field into a newly allocated cell of the
+// given type
+void *csv_parse_cell( enum types type, char *str ){
+	void *cell;
+	size_t len;
+	switch( type ){
+		case csv_number :
+			return dfloat64_atof( str );
+		case csv_int64 :
+			cell = malloc( sizeof( int64_t ) );
+			*(int64_t *) cell = strtoll( str, NULL, 10 );
+			return cell;
+		case csv_double :
+			cell = malloc( sizeof( double ) );
+			*(double *) cell = strtod( str, NULL );
+			return cell;
+		default :
+			len = strlen( str ) + 1;
+			cell = malloc( len );
+			memcpy( cell, str, len );
+			return cell;
+	}
+}
+
+// Returns a newly allocated copy of a cell of the given type
+void *csv_copy_cell( enum types type, void *cell ){
+	void *copy;
+	size_t size;
+	switch( type ){
+		case csv_number : size = sizeof( dfloat64_t ); break;
+		case csv_int64 : size = sizeof( int64_t ); break;
+		case csv_double : size = sizeof( double ); break;
+		default : size = strlen( (char *) cell ) + 1; break;
+	}
+	copy = malloc( size );
+	memcpy( copy, cell, size );
+	return copy;
+}
+
+// Compares two cells of the given type; returns a negative number,
+// zero or a positive number like strcmp()
+int csv_compare_cells( enum types type, void *a, void *b ){
+	int64_t x, y;
+	double u, v;
+	switch( type ){
+		case csv_number :
+			return dfloat64_cmp( (dfloat64_t *) a, (dfloat64_t *) b );
+		case csv_int64 :
+			x = *(int64_t *) a;
+			y = *(int64_t *) b;
+			return (x > y) - (x < y);
+		case csv_double :
+			u = *(double *) a;
+			v = *(double *) b;
+			// NaN sorts after every other value and equals itself
+			if( u != u || v != v )
+				return (u != u) - (v != v);
+			return (u > v) - (u < v);
+		default :
+			return strcmp( (char *) a, (char *) b );
+	}
+}
+
+// Rewrites a number with the exponent e without changing its value;
+// returns false and leaves it alone if its mantissa would not fit
+bool csv_rescale( dfloat64_t *val, int32_t e ){
+	int32_t m, d;
+	int64_t scaled;
+	m = val->mantissa;
+	d = val->exponent;
+	if( m ){
+		// Drop trailing zeros to reach a larger exponent
+		while( d < e && m % 10 == 0 ){
+			m /= 10;
+			d++;
+		}
+		if( d < e || (int64_t) d - e > KERNEL_MAX_SCALE )
+			return false;
+		scaled = (int64_t) m * csv_pow10[d - e];
+		if( scaled > INT32_MAX || scaled < INT32_MIN )
+			return false;
+		val->mantissa = (int32_t) scaled;
+	}
+	val->exponent = e;
+	return true;
+}
+
+// Returns the mantissa of a cell of a fixed-point field at the scale
+// e of the field, which csv_fix_field() made sure is exact and fits
+int32_t csv_fixed_mantissa( dfloat64_t *val, int32_t e ){
+	if( !val->mantissa )
+		return 0;
+	if( val->exponent >= e )
+		return (int32_t) (val->mantissa * csv_pow10[val->exponent - e]);
+	// Trailing zeros below the scale
+	return (int32_t) (val->mantissa / csv_pow10[e - val->exponent]);
+}
+
+// Prepares the conversion of the cells of field f of a table to
+// double precision
+void csv_prepare_converter( csv_table *table, int f, csv_converter *conv ){
+	int32_t e;
+	conv->type = table->header[f]->type;
+	conv->fixed = conv->type == csv_number && csv_is_fixed( table, f );
+	conv->divide = false;
+	conv->power = 1;
+	conv->scale = 0;
+	if( conv->fixed ){
+		conv->scale = table->scales[f];
+		conv->divide = table->scales[f] < 0;
+		for( e = table->scales[f]; e != 0; e += conv->divide ? 1 : -1 )
+			conv->power *= 10;
+	}
+}
+
+// Converts a cell to double precision
+double csv_convert_cell( csv_converter *conv, void *cell ){
+	dfloat64_t *val;
+	switch( conv->type ){
+		case csv_int64 :
+			return (double) *(int64_t *) cell;
+		case csv_double :
+			return *(double *) cell;
+		default :
+			val = (dfloat64_t *) cell;
+			if( !conv->fixed )
+				return csv_dfloat_to_double( val );
+			// A single rounding instead of one for each power of ten
+			return conv->divide ? csv_fixed_mantissa( val, conv->scale ) / conv->power : csv_fixed_mantissa( val, conv->scale ) * conv->power;
+	}
+}
@@ -0,0 +1,125 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Export of number fields    *
+ *                 as dense matrices          *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "zone.h"
+
+/*
+ * The table is split into chunks of whole zones, and each chunk
+ * writes the rows of its own records, which start at the number of
+ * records in the chunks before it. Chunks never write the same
+ * element of the matrix, so they can be converted by different
+ * threads without any locking.
+ */
+
+// State shared by the workers of a conversion
+typedef struct {
+	csv_table *table;
+	int ncols;
+	int *fields;
+	csv_converter *converters;
+	enum layouts layout;
+	int rows;
+	double *dout;                       // Output of csv_to_matrix()
+	float *fout;                        // Output of csv_to_matrix_float()
+	int nchunks;
+	csv_record *first[CSV_MAX_THREADS]; // First record of each chunk
+	int count[CSV_MAX_THREADS];         // # of records in each chunk
+	int start[CSV_MAX_THREADS];         // Row of the first record of each chunk
+} matrix_job;
+
+// Converts the records of chunks lo through hi - 1
+static void convert_chunks( void *arg, int lo, int hi ){
+	matrix_job *job = (matrix_job *) arg;
+	csv_record *rec;
+	double x;
+	size_t pos;
+	int c, i, j, row;
+	for( c = lo; c < hi; c++ ){
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next ){
+			row = job->start[c] + i;
+			for( j = 0; j < job->ncols; j++ ){
+				x = csv_convert_cell( job->converters + j, rec->record[job->fields[j]] );
+				if( job->layout == ROW_MAJOR )
+					pos = (size_t) row * job->ncols + j;
+				else
+					pos = (size_t) j * job->rows + row;
+				if( job->dout )
+					job->dout[pos] = x;
+				else
+					job->fout[pos] = (float) x;
+			}
+		}
+	}
+}
+
+// Converts the fields of a table named in columns into a matrix with
+// one row per record, writing either dout or fout; returns false if
+// a field does not exist or is a string field
+static bool to_matrix( csv_table *table, int ncols, char **columns, enum layouts layout, double *dout, float *fout ){
+	matrix_job *job;
+	int i, f, c;
+
+	job = (matrix_job *) calloc( 1, sizeof( matrix_job ) );
+	job->fields = (int *) malloc( (ncols ? ncols : 1) * sizeof( int ) );
+	job->converters = (csv_converter *) malloc( (ncols ? ncols : 1) * sizeof( csv_converter ) );
+	for( i = 0; i < ncols; i++ ){
+		for( f = 0; f < table->rlen; f++ ){
+			if( !strcmp( table->header[f]->name, columns[i] ) )
+				break;
+		}
+		if( f == table->rlen || table->header[f]->type == csv_string ){
+		// Error: Name not found or type mismatch
+			free( job->fields );
+			free( job->converters );
+			free( job );
+			return false;
+		}
+		job->fields[i] = f;
+		csv_prepare_converter( table, f, job->converters + i );
+	}
+	job->table = table;
+	job->ncols = ncols;
+	job->layout = layout;
+	job->dout = dout;
+	job->fout = fout;
+
+	// Number the rows of the chunks before they are spread out
+	job->nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	job->rows = 0;
+	for( c = 0; c < job->nchunks; c++ ){
+		job->start[c] = job->rows;
+		job->rows += job->count[c];
+	}
+	csv_parallel_for( job->nchunks, convert_chunks, job );
+	free( job->fields );
+	free( job->converters );
+	free( job );
+	return true;
+}
+
+// Writes the number fields of a table named in columns to out as a
+// dense matrix of doubles with one row per record and one column per
+// field, in row-major or column-major order; out must hold
+// csv_count_records( table ) * ncols doubles. Returns false if a
+// field does not exist or is a string field.
+bool csv_to_matrix( csv_table *table, int ncols, char **columns, enum layouts layout, double *out ){
+	return to_matrix( table, ncols, columns, layout, out, NULL );
+}
+
+// Same as csv_to_matrix(), but writes single-precision floats
+bool csv_to_matrix_float( csv_table *table, int ncols, char **columns, enum layouts layout, float *out ){
+	return to_matrix( table, ncols, columns, layout, NULL, out );
+}
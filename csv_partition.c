@@ -0,0 +1,204 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Partitioning of tables     *
+ *                 into K subtables           *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
+
+/*
+ * The table is split into chunks of whole zones. Each chunk copies
+ * its records onto K chains of its own, one for each partition,
+ * so chunks can be processed by different threads without sharing
+ * anything. The chains of each partition are then linked together
+ * in chunk order, which keeps the records of every partition in
+ * the order they had in the original table.
+ */
+
+// Records copied by one chunk into one partition
+typedef struct {
+	csv_record *head;
+	csv_record *tail;
+} part_chain;
+
+// State shared by the workers of a partitioning
+typedef struct {
+	csv_table *table;
+	int field;
+	int k;
+	bool ranged;          // Partition by range rather than by hash
+	void **bounds;        // Range boundaries, as cells of the field
+	csv_record **first;   // First record of each chunk
+	int *count;           // # of records in each chunk
+	int nchunks;
+	part_chain *chains;   // k chains for each chunk
+	csv_table **parts;
+} part_job;
+
+// Returns the partition of a value given k - 1 ascending range
+// boundaries: the number of boundaries less than or equal to it
+static int range_of( part_job *job, void *cell ){
+	int lo, hi, mid, c;
+	lo = 0;
+	hi = job->k - 1;
+	while( lo < hi ){
+		mid = (lo + hi) / 2;
+		c = csv_compare_cells( job->table->header[job->field]->type, job->bounds[mid], cell );
+		if( c <= 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Makes a deep copy of the values of a record
+static csv_record *copy_record( csv_table *table, csv_record *rec ){
+	csv_record *copy;
+	int f;
+	copy = (csv_record *) calloc( 1, sizeof( csv_record ) );
+	copy->record = (void **) calloc( table->rlen, sizeof( void * ) );
+	for( f = 0; f < table->rlen; f++ )
+		copy->record[f] = csv_copy_cell( table->header[f]->type, rec->record[f] );
+	return copy;
+}
+
+// Copies the records of chunks lo through hi - 1 onto the chains
+// of their partitions
+static void split_chunks( void *arg, int lo, int hi ){
+	part_job *job = (part_job *) arg;
+	part_chain *chain;
+	csv_record *rec, *copy;
+	void *cell;
+	int c, i, p;
+	for( c = lo; c < hi; c++ ){
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next ){
+			cell = rec->record[job->field];
+			if( job->ranged )
+				p = range_of( job, cell );
+			else
+				p = (int) (csv_hash_cell( job->table, job->field, cell ) % job->k);
+			copy = copy_record( job->table, rec );
+			chain = job->chains + (size_t) c * job->k + p;
+			if( chain->tail )
+				chain->tail->next = copy;
+			else
+				chain->head = copy;
+			chain->tail = copy;
+		}
+	}
+}
+
+// Links the chains of partitions lo through hi - 1 into their
+// tables and numbers and summarizes their records
+static void join_chains( void *arg, int lo, int hi ){
+	part_job *job = (part_job *) arg;
+	part_chain *chain;
+	csv_record *tail, *rec;
+	csv_table *part;
+	int c, p, row;
+	for( p = lo; p < hi; p++ ){
+		part = job->parts[p];
+		tail = part->start;
+		for( c = 0; c < job->nchunks; c++ ){
+			chain = job->chains + (size_t) c * job->k + p;
+			if( chain->head ){
+				tail->next = chain->head;
+				tail = chain->tail;
+			}
+		}
+		row = 0;
+		for( rec = part->start->next; rec; rec = rec->next ){
+			rec->row = row++;
+			csv_zone_add( part, rec );
+		}
+	}
+}
+
+// Splits a table into k new tables in a single pass, putting each
+// record into the table given by its value of field f
+static csv_table **partition_table( csv_table *table, int f, int k, bool ranged, void **bounds ){
+	part_job job;
+	int c, nchunks;
+	job.table = table;
+	job.field = f;
+	job.k = k;
+	job.ranged = ranged;
+	job.bounds = bounds;
+	job.parts = (csv_table **) malloc( k * sizeof( csv_table * ) );
+	for( c = 0; c < k; c++ ){
+		job.parts[c] = csv_create_table( table->rlen, table->header );
+		csv_copy_fixed( job.parts[c], table );
+	}
+
+	// Divide the table into at most one chunk per thread
+	job.first = (csv_record **) malloc( CSV_MAX_THREADS * sizeof( csv_record * ) );
+	job.count = (int *) malloc( CSV_MAX_THREADS * sizeof( int ) );
+	nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job.first, job.count );
+	job.nchunks = nchunks;
+	job.chains = (part_chain *) calloc( (size_t) nchunks * k, sizeof( part_chain ) );
+
+	csv_parallel_for( nchunks, split_chunks, &job );
+	csv_parallel_for( k, join_chains, &job );
+
+	free( job.chains );
+	free( job.first );
+	free( job.count );
+	return job.parts;
+}
+
+// Splits a table into k new tables by the hash of the field given
+// by name, so that records with equal values end up in the same
+// table; returns an array of k tables, or NULL on error
+csv_table **csv_partition_table_by_hash( csv_table *table, char *name, int k ){
+	int f;
+	// Find the field with the given name:
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, name ) )
+			break;
+	}
+	if( f == table->rlen || k < 1 )
+	// Error: Name not found or invalid number of partitions
+		return NULL;
+	return partition_table( table, f, k, false, NULL );
+}
+
+// Splits a table into k new tables by ranges of the field given by
+// name; bounds holds k - 1 ascending boundaries, and table i gets
+// the records whose value v satisfies bounds[i-1] <= v < bounds[i];
+// returns an array of k tables, or NULL on error
+csv_table **csv_partition_table_by_range( csv_table *table, char *name, int k, char **bounds ){
+	csv_table **parts;
+	void **cells;
+	int f, i;
+	// Find the field with the given name:
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, name ) )
+			break;
+	}
+	if( f == table->rlen || k < 1 )
+	// Error: Name not found or invalid number of partitions
+		return NULL;
+	if( table->header[f]->type == csv_string )
+		return partition_table( table, f, k, true, (void **) bounds );
+	// Parse the boundaries of other fields once
+	cells = (void **) malloc( k * sizeof( void * ) );
+	for( i = 0; i < k - 1; i++ )
+		cells[i] = csv_parse_cell( table->header[f]->type, bounds[i] );
+	parts = partition_table( table, f, k, true, cells );
+	for( i = 0; i < k - 1; i++ )
+		free( cells[i] );
+	free( cells );
+	return parts;
+}
@@ -0,0 +1,294 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Lazy queries combining     *
+ *                 selection, projection,     *
+ *                 sorting and aggregation    *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "zone.h"
+#include "sort.h"
+
+/*
+ * A query only records its operators until csv_query_execute() is
+ * called, which runs them in the order of SQL regardless of the
+ * order they were added in: WHERE, GROUP BY, ORDER BY, then the
+ * projection.
+ *
+ * Every filter produces a set of rows, and the sets are intersected
+ * into one. Without aggregation, the records of the rows in the set
+ * are gathered into an array of pointers and sorted in place; with
+ * aggregation, the set is handed to csv_group_by_subset(). Either
+ * way, no record is copied until the very end, when the projected
+ * fields of the final records are copied into the result table.
+ */
+
+// Kinds of filters
+enum filters { FILTER_SUBSET, FILTER_PREDICATE, FILTER_EXPR };
+
+// Condition added by one of the csv_query_where_*() functions
+typedef struct {
+	enum filters kind;
+	void *filter; // csv_set, csv_predicate or csv_expr
+} query_filter;
+
+struct _csv_query {
+	csv_table *table;
+	query_filter *filters;
+	int nfilters;
+	int ncols;                   // Projected fields, all if 0
+	char **columns;
+	int nkeys;                   // ORDER BY fields
+	char **keys;
+	enum directions *directions;
+	bool grouped;                // True if csv_query_group_by() was called
+	int ngroups;                 // GROUP BY fields
+	char **groups;
+	int naggs;
+	csv_aggregate *aggs;
+};
+
+// Returns a copy of an array of n elements of the given size
+static void *copy_array( void *src, int n, size_t size ){
+	void *dst;
+	dst = malloc( (n ? n : 1) * size );
+	if( n )
+		memcpy( dst, src, n * size );
+	return dst;
+}
+
+// Starts a query on a table
+csv_query *csv_query_from( csv_table *table ){
+	csv_query *query;
+	query = (csv_query *) calloc( 1, sizeof( csv_query ) );
+	query->table = table;
+	return query;
+}
+
+// Adds a filter of any kind to a query
+static void add_filter( csv_query *query, enum filters kind, void *filter ){
+	query->filters = (query_filter *) realloc( query->filters, (query->nfilters + 1) * sizeof( query_filter ) );
+	query->filters[query->nfilters].kind = kind;
+	query->filters[query->nfilters].filter = filter;
+	query->nfilters++;
+}
+
+// Keeps only the rows in subset
+void csv_query_where_subset( csv_query *query, csv_set *subset ){
+	add_filter( query, FILTER_SUBSET, subset );
+}
+
+// Keeps only the rows that satisfy a prepared predicate
+void csv_query_where_predicate( csv_query *query, csv_predicate *pred ){
+	add_filter( query, FILTER_PREDICATE, pred );
+}
+
+// Keeps only the rows that satisfy a compiled expression
+void csv_query_where_expr( csv_query *query, csv_expr *expr ){
+	add_filter( query, FILTER_EXPR, expr );
+}
+
+// Keeps only the ncols fields named in columns, in that order;
+// after csv_query_group_by(), these are names of result fields
+void csv_query_select( csv_query *query, int ncols, char **columns ){
+	free( query->columns );
+	query->ncols = ncols;
+	query->columns = (char **) copy_array( columns, ncols, sizeof( char * ) );
+}
+
+// Sorts the result like csv_sort_table(); after csv_query_group_by(),
+// the keys are names of result fields
+void csv_query_order_by( csv_query *query, int nkeys, char **keys, enum directions *directions ){
+	free( query->keys );
+	free( query->directions );
+	query->nkeys = nkeys;
+	query->keys = (char **) copy_array( keys, nkeys, sizeof( char * ) );
+	query->directions = (enum directions *) copy_array( directions, nkeys, sizeof( enum directions ) );
+}
+
+// Aggregates the result like csv_group_by()
+void csv_query_group_by( csv_query *query, int nkeys, char **keys, int naggs, csv_aggregate *aggs ){
+	free( query->groups );
+	free( query->aggs );
+	query->grouped = true;
+	query->ngroups = nkeys;
+	query->groups = (char **) copy_array( keys, nkeys, sizeof( char * ) );
+	query->naggs = naggs;
+	query->aggs = (csv_aggregate *) copy_array( aggs, naggs, sizeof( csv_aggregate ) );
+}
+
+// Frees a set created by a filter
+static void free_set( csv_set *set ){
+	free( set->bits );
+	free( set );
+}
+
+// Intersects the filters of a query into a new set, or returns NULL
+// if the query has no filters
+static csv_set *filter_rows( csv_query *query ){
+	csv_set *subset, *s;
+	query_filter *filter;
+	int i;
+	subset = NULL;
+	for( i = 0; i < query->nfilters; i++ ){
+		filter = query->filters + i;
+		if( filter->kind == FILTER_SUBSET ){
+			s = (csv_set *) filter->filter;
+			if( subset )
+				csv_set_intersection( subset, s );
+			else{
+				// Copy the caller's set before changing it
+				subset = (csv_set *) malloc( sizeof( csv_set ) );
+				subset->size = s->size;
+				subset->bits = (uint8_t *) copy_array( s->bits, s->size, 1 );
+			}
+			continue;
+		}
+		if( filter->kind == FILTER_PREDICATE )
+			s = csv_select_subset_by_predicate( query->table, (csv_predicate *) filter->filter );
+		else
+			s = csv_select_subset_by_expr( query->table, (csv_expr *) filter->filter );
+		if( subset ){
+			csv_set_intersection( subset, s );
+			free_set( s );
+		}
+		else
+			subset = s;
+	}
+	return subset;
+}
+
+// Finds the fields of a table named in names; returns false if a
+// name does not exist
+static bool find_fields( csv_table *table, int n, char **names, int *fields ){
+	int i, f;
+	for( i = 0; i < n; i++ ){
+		for( f = 0; f < table->rlen; f++ ){
+			if( !strcmp( table->header[f]->name, names[i] ) )
+				break;
+		}
+		if( f == table->rlen )
+		// Error: Name not found
+			return false;
+		fields[i] = f;
+	}
+	return true;
+}
+
+// Copies the given fields of n records into a new table
+static csv_table *materialize( csv_table *table, csv_record **recs, int n, int rlen, int *fields ){
+	csv_field **header;
+	csv_table *result;
+	csv_record *rec, *tail;
+	size_t len;
+	char *name;
+	int i, f;
+	header = (csv_field **) malloc( rlen * sizeof( csv_field * ) );
+	for( f = 0; f < rlen; f++ )
+		header[f] = table->header[fields[f]];
+	result = csv_create_table( rlen, header );
+	free( header );
+	if( table->own_names ){
+		// Keep copies of names that go away with their table, such
+		// as those of a grouped table dropped after the query
+		for( f = 0; f < rlen; f++ ){
+			len = strlen( result->header[f]->name ) + 1;
+			name = (char *) malloc( len );
+			memcpy( name, result->header[f]->name, len );
+			result->header[f]->name = name;
+		}
+		result->own_names = true;
+	}
+
+	tail = result->start;
+	for( i = 0; i < n; i++ ){
+		rec = (csv_record *) calloc( 1, sizeof( csv_record ) );
+		rec->record = (void **) calloc( rlen, sizeof( void * ) );
+		rec->row = i;
+		for( f = 0; f < rlen; f++ ){
+			rec->record[f] = csv_copy_cell( table->header[fields[f]]->type, recs[i]->record[fields[f]] );
+		}
+		tail->next = rec;
+		tail = rec;
+		csv_zone_add( result, rec );
+	}
+	return result;
+}
+
+// Runs a query and returns its result as a new table, or NULL if a
+// field does not exist or an aggregate is invalid; the query can be
+// run again, and the sets, predicates and expressions given to it
+// must still be valid
+csv_table *csv_query_execute( csv_query *query ){
+	csv_table *source, *grouped, *result;
+	csv_record **recs;
+	csv_record *rec;
+	csv_set *subset;
+	int *keys, *fields;
+	int i, n, rlen;
+
+	subset = filter_rows( query );
+	grouped = NULL;
+	if( query->grouped ){
+		grouped = csv_group_by_subset( query->table, subset, query->ngroups, query->groups, query->naggs, query->aggs );
+		if( subset )
+			free_set( subset );
+		subset = NULL;
+		if( !grouped )
+		// Error: Invalid grouping
+			return NULL;
+	}
+	source = grouped ? grouped : query->table;
+
+	// Gather the records that passed the filters
+	n = 0;
+	for( rec = source->start->next; rec; rec = rec->next )
+		n++;
+	recs = (csv_record **) malloc( (n ? n : 1) * sizeof( csv_record * ) );
+	n = 0;
+	for( rec = source->start->next; rec; rec = rec->next ){
+		if( !subset || csv_set_member( rec->row, subset ) )
+			recs[n++] = rec;
+	}
+	if( subset )
+		free_set( subset );
+
+	rlen = query->ncols ? query->ncols : source->rlen;
+	keys = (int *) malloc( (query->nkeys ? query->nkeys : 1) * sizeof( int ) );
+	fields = (int *) malloc( (rlen ? rlen : 1) * sizeof( int ) );
+	result = NULL;
+	if( find_fields( source, query->nkeys, query->keys, keys ) &&
+	    find_fields( source, query->ncols, query->columns, fields ) ){
+		if( !query->ncols ){
+			for( i = 0; i < rlen; i++ )
+				fields[i] = i;
+		}
+		csv_sort_records( source, query->nkeys, keys, query->directions, recs, n );
+		result = materialize( source, recs, n, rlen, fields );
+	}
+	free( keys );
+	free( fields );
+	free( recs );
+	if( grouped )
+		csv_drop_table( grouped );
+	return result;
+}
+
+// Frees a query; the table and filters given to it are left alone
+void csv_free_query( csv_query *query ){
+	free( query->filters );
+	free( query->columns );
+	free( query->keys );
+	free( query->directions );
+	free( query->groups );
+	free( query->aggs );
+	free( query );
+}
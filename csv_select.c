@@ -10,98 +10,321 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "csv.h"
 #include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
 
-// Creates a set type indexing the records in a table that
-// match the expression given by the operator and operand
-csv_set *csv_select_subset( csv_table *table, enum operators operator, char *field, char *value ){
-	csv_set *subset;
-	int rcount; // # of records in table
-	csv_record *save;
-	int i, f;
-	dfloat64_t *number_field;
+// Parses the operand of a comparison on an int64 field; integers
+// are parsed exactly, anything else goes through csv_integer_operand()
+// so that other spellings of integers, such as 5.0 or 1e3, are
+// still integers
+static void parse_integer( csv_predicate *pred, char *value ){
+	char *end;
+	pred->integer = strtoll( value, &end, 10 );
+	pred->whole = true;
+	if( *end != '\0' )
+		csv_integer_operand( pred, strtod( value, NULL ) );
+}
+
+// Resolves the field named by a condition and parses its
+// operand so that the condition can be evaluated without
+// any per-record lookups or conversions
+csv_predicate *csv_prepare_predicate( csv_table *table, enum operators operator, char *field, char *value ){
+	csv_predicate *pred;
 	dfloat64_t *number_value;
-	int int1, int2;
-	char *string_field;
-	save = table->cur;
+	int f;
+
+	pred = (csv_predicate *) calloc( 1, sizeof( csv_predicate ) );
+	pred->operator = operator;
+	pred->field = -1;
+
+	if( operator == MOD ){
+		pred->modulus = atoi( field );
+		pred->residue = atoi( value );
+		if( pred->modulus <= 0 ){
+		// Error: Invalid modulus
+			free( pred );
+			return NULL;
+		}
+		return pred;
+	}
 
 	// Find the field with the given name:
-	if( operator != MOD ){
-		for( f = 0; f < table->rlen; f++ ){
-			if( !strcmp( table->header[f]->name, field ) )
-				break;
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, field ) )
+			break;
+	}
+	if( f == table->rlen ){
+	// Error: Name not found
+		free( pred );
+		return NULL;
+	}
+	pred->field = f;
+	pred->type = table->header[f]->type;
+
+	if( operator == SEQ || operator == SNE ){
+		if( table->header[f]->type != csv_string ){
+		// Error: Type mismatch
+			free( pred );
+			return NULL;
 		}
-		if( f == table->rlen )
-		// Error: Name not found
+		pred->string = (char *) malloc( strlen( value ) + 1 );
+		strcpy( pred->string, value );
+	}
+	else if( table->header[f]->type == csv_int64 )
+		parse_integer( pred, value );
+	else if( table->header[f]->type == csv_double )
+		pred->real = strtod( value, NULL );
+	else{
+		if( table->header[f]->type != csv_number ){
+		// Error: Type mismatch
+			free( pred );
 			return NULL;
+		}
+		number_value = dfloat64_atof( value );
+		memcpy( &pred->number, number_value, sizeof( dfloat64_t ) );
+		free( number_value );
 	}
+	return pred;
+}
 
-	// Count records in table and use record
-	// count to create an empty set object:
-	csv_rewind( table );
-	rcount = 0;
-	while( csv_next_record( table ) )
-		rcount++;
-	csv_rewind( table );
-	subset = csv_empty_set( rcount );
+// Frees a predicate returned by csv_prepare_predicate()
+void csv_free_predicate( csv_predicate *pred ){
+	if( pred->string )
+		free( pred->string );
+	free( pred );
+}
+
+// Answers a numerical comparison with an index on the field: the
+// matching records occupy a contiguous range of the index, so only
+// they are visited
+static csv_set *select_by_index( csv_index *index, csv_predicate *pred ){
+	csv_set *subset;
+	void *operand;
+	double nan;
+	int lo, hi, i;
+	lo = 0;
+	hi = index->count;
+	switch( pred->type ){
+		case csv_int64 : operand = &pred->integer; break;
+		case csv_double : operand = &pred->real; break;
+		default : operand = &pred->number; break;
+	}
+	switch( pred->operator ){
+		case EQ :
+			lo = csv_index_lower_bound( index, operand );
+			hi = csv_index_upper_bound( index, operand );
+			break;
+		case LT : hi = csv_index_lower_bound( index, operand ); break;
+		case LE : hi = csv_index_upper_bound( index, operand ); break;
+		case GT : lo = csv_index_upper_bound( index, operand ); break;
+		case GE : lo = csv_index_lower_bound( index, operand ); break;
+		default : break;
+	}
+	if( pred->type == csv_double ){
+		// NaNs sort last and satisfy no comparison, nor does a NaN operand
+		nan = NAN;
+		if( pred->real != pred->real )
+			lo = hi;
+		else if( hi > (i = csv_index_lower_bound( index, &nan )) )
+			hi = i;
+	}
+	else if( pred->type == csv_int64 && !pred->whole && (pred->operator == EQ || pred->real != pred->real) )
+	// A fraction never equals an integer, and NaN equals nothing
+		lo = hi;
+	subset = csv_empty_set( index->count );
+	for( i = lo; i < hi; i++ )
+		csv_set_add( subset, index->records[i]->row );
+	return subset;
+}
+
+// Answers a string comparison with a hash index on the field by
+// visiting only the records whose field equals the operand
+static csv_set *select_by_hash( csv_index *index, csv_predicate *pred ){
+	index_cursor cursor;
+	csv_record *rec;
+	csv_set *subset;
+	subset = csv_empty_set( index->count );
+	if( pred->operator == SNE )
+	// Start from every record and remove the matches
+		csv_fill_bits( subset->bits, index->count );
+	csv_index_open( index, pred->string, &cursor );
+	while( (rec = csv_index_match( index, pred->string, &cursor )) ){
+		if( pred->operator == SEQ )
+			csv_set_add( subset, rec->row );
+		else
+			csv_set_del( subset, rec->row );
+	}
+	return subset;
+}
 
-	for( i = 0; i < rcount; i++ ){
-		csv_next_record( table );
-		if( operator == EQ || operator == NE || operator == LT || operator == GT || operator == LE || operator == GE ){
-		// Numerical comparison operators
-			if( table->header[f]->type != csv_number )
-				return NULL;
-			number_field = csv_get_number_field_by_name( table, field );
-			number_value = dfloat64_atof( value );
-			switch( operator ){
-				case EQ : if( !dfloat64_cmp( number_field, number_value ) )
-						csv_set_add( subset, i );
-				          break;
-				case NE : if( dfloat64_cmp( number_field, number_value ) )
-						csv_set_add( subset, i );
-				          break;
-				case LT : if( dfloat64_cmp( number_field, number_value ) == -1 )
-						csv_set_add( subset, i );
-				          break;
-
-				case GT : if( dfloat64_cmp( number_field, number_value ) == 1 )
-						csv_set_add( subset, i );
-				          break;
-
-				case LE : if( dfloat64_cmp( number_field, number_value ) <= 0 )
-						csv_set_add( subset, i );
-				          break;
-				case GE : if( dfloat64_cmp( number_field, number_value ) >= 0 )
-						csv_set_add( subset, i );
-				          break;
+// Evaluates a string or numerical comparison on n consecutive
+// records starting with rec and stores the results in bits; the
+// first record must correspond to the first bit of bits[0]
+static void select_range( csv_table *table, csv_predicate *pred, csv_record *rec, int n, uint8_t *bits ){
+	dfloat64_t *cells[KERNEL_BLOCK];
+	int64_t values[KERNEL_BLOCK];
+	double reals[KERNEL_BLOCK];
+	uint8_t truth[KERNEL_BLOCK];
+	dfloat64_t operand;
+	int64_t k;
+	int i, m, f, mask;
+	uint8_t byte;
+	f = pred->field;
+	if( pred->operator == SEQ || pred->operator == SNE ){
+		// String comparison operators build the set one byte at a time
+		// and store it whenever the eighth record of the byte has been tested
+		mask = (pred->operator == SEQ);
+		byte = 0;
+		for( i = 0; i < n; i++, rec = rec->next ){
+			byte |= ((!strcmp( (char *) rec->record[f], pred->string )) == mask) << (i & 7);
+			if( (i & 7) == 7 ){
+				bits[i >> 3] = byte;
+				byte = 0;
 			}
-			free( number_field );
-			free( number_value );
-		}
-		else if( operator == MOD ){
-		// Modulus operator
-			int1 = atoi( field );
-			int2 = atoi( value );
-			if( i % int1 == int2 )
-				csv_set_add( subset, i );
 		}
-		else if( operator == SEQ || operator == SNE ){
-		// String comparison operators
-			if( table->header[f]->type != csv_string )
-				return NULL;
-			string_field = csv_get_string_field_by_name( table, field );
-			if( operator == SEQ ){
-				if( !strcmp( string_field, value ) )
-					csv_set_add( subset, i );
+		if( i & 7 )
+			bits[i >> 3] = byte;
+		return;
+	}
+	if( pred->type == csv_int64 || pred->type == csv_double ){
+		// Native numbers are gathered into a contiguous block and
+		// compared with plain machine arithmetic
+		for( i = 0; i < n; i += m ){
+			if( pred->type == csv_int64 ){
+				for( m = 0; m < KERNEL_BLOCK && i + m < n; rec = rec->next )
+					values[m++] = *(int64_t *) rec->record[f];
+				csv_compare_natives( pred, values, m, truth );
 			}
 			else{
-				if( strcmp( string_field, value ) )
-					csv_set_add( subset, i );
+				for( m = 0; m < KERNEL_BLOCK && i + m < n; rec = rec->next )
+					reals[m++] = *(double *) rec->record[f];
+				csv_compare_natives( pred, reals, m, truth );
 			}
+			csv_pack_bits( truth, m, bits + (i >> 3) );
 		}
+		return;
 	}
-	table->cur = save;
+	operand = pred->number;
+	if( csv_is_fixed( table, f ) && csv_rescale( &operand, table->scales[f] ) ){
+		// Fixed-point mantissas are taken at the exponent of the
+		// operand, so they are compared without normalizing
+		for( i = 0; i < n; i += m ){
+			for( m = 0; m < KERNEL_BLOCK && i + m < n; rec = rec->next )
+				values[m++] = csv_fixed_mantissa( (dfloat64_t *) rec->record[f], table->scales[f] );
+			csv_compare_block( values, m, operand.mantissa, pred->operator, truth );
+			csv_pack_bits( truth, m, bits + (i >> 3) );
+		}
+		return;
+	}
+	// Numerical comparison operators are evaluated one block
+	// at a time by the comparison kernels
+	for( i = 0; i < n; i += m ){
+		for( m = 0; m < KERNEL_BLOCK && i + m < n; rec = rec->next )
+			cells[m++] = (dfloat64_t *) rec->record[f];
+		if( csv_normalize_block( cells, m, &pred->number, values, &k ) )
+			csv_compare_block( values, m, k, pred->operator, truth );
+		else
+			csv_compare_block_slow( cells, m, &pred->number, pred->operator, truth );
+		csv_pack_bits( truth, m, bits + (i >> 3) );
+	}
+}
+
+// Selection spread over the zones of a table
+typedef struct {
+	csv_table *table;
+	csv_predicate *pred;
+	csv_set *subset;
+} select_job;
+
+// Evaluates a selection on zones lo through hi - 1; each zone
+// owns ZONE_SIZE / 8 bytes of the set, so calls on disjoint
+// ranges of zones can run concurrently
+static void select_zones( void *arg, int lo, int hi ){
+	select_job *job = (select_job *) arg;
+	csv_predicate *pred = job->pred;
+	csv_zone *zone;
+	uint8_t *bits;
+	int z;
+	// Only look at the records of zones whose statistics leave
+	// the outcome open
+	for( z = lo; z < hi; z++ ){
+		zone = job->table->zones + z;
+		bits = job->subset->bits + z * (ZONE_SIZE / 8);
+		switch( csv_zone_test( job->table, zone, pred ) ){
+			case ZONE_NEVER :
+				break;
+			case ZONE_ALWAYS :
+				csv_fill_bits( bits, zone->count );
+				break;
+			case ZONE_MAYBE :
+				select_range( job->table, pred, zone->first, zone->count, bits );
+				break;
+		}
+	}
+}
+
+// Creates a set type indexing the records in a table that
+// match a prepared predicate
+csv_set *csv_select_subset_by_predicate( csv_table *table, csv_predicate *pred ){
+	csv_set *subset;
+	csv_index *index;
+	select_job job;
+	int rcount; // # of records in table
+	int i;
+	uint8_t byte;
+
+	// Conditions on an indexed field don't need a scan
+	if( pred->operator != NE && pred->operator != MOD && (index = csv_find_index( table, pred->field )) ){
+		if( index->hashed )
+			return select_by_hash( index, pred );
+		return select_by_index( index, pred );
+	}
+
+	rcount = table->zcount ? csv_zone_rows( table ) : csv_count_records( table );
+	subset = csv_empty_set( rcount );
+
+	if( pred->operator == MOD ){
+		// Modulus operator
+		byte = 0;
+		for( i = 0; i < rcount; i++ ){
+			byte |= (i % pred->modulus == pred->residue) << (i & 7);
+			if( (i & 7) == 7 ){
+				subset->bits[i >> 3] = byte;
+				byte = 0;
+			}
+		}
+		if( i & 7 )
+			subset->bits[i >> 3] = byte;
+		return subset;
+	}
+
+	if( !table->zcount ){
+		select_range( table, pred, table->start->next, rcount, subset->bits );
+		return subset;
+	}
+
+	// Zones are spread across threads when built with _CSV_THREADS
+	job.table = table;
+	job.pred = pred;
+	job.subset = subset;
+	csv_parallel_for( table->zcount, select_zones, &job );
+	return subset;
+}
+
+// Creates a set type indexing the records in a table that
+// match the expression given by the operator and operand
+csv_set *csv_select_subset( csv_table *table, enum operators operator, char *field, char *value ){
+	csv_predicate *pred;
+	csv_set *subset;
+	pred = csv_prepare_predicate( table, operator, field, value );
+	if( !pred )
+		return NULL;
+	subset = csv_select_subset_by_predicate( table, pred );
+	csv_free_predicate( pred );
 	return subset;
 }
 
@@ -113,6 +336,7 @@ csv_table *csv_select_records_by_subset( csv_table *table, csv_set *subset ){
 	int rnum;
 	save = table->cur;
 	subtab = csv_create_table( table->rlen, table->header );
+	csv_copy_fixed( subtab, table );
 	csv_rewind( table );
 	rnum = 0;
 	// Loop copies from table to subtab all records whose bit in the
@@ -134,6 +358,9 @@ csv_partition *csv_partition_table_by_subset( csv_table *table, csv_set *subset
 	partition = (csv_partition *) malloc( sizeof( csv_partition ) );
 	partition->ident = csv_create_table( table->rlen, table->header );
 	partition->cplmt = csv_create_table( table->rlen, table->header );
+	csv_copy_fixed( partition->ident, table );
+	csv_copy_fixed( partition->cplmt, table );
+	csv_rewind( table );
 	rnum = 0;
 	// Loop copies all records with 1 bits to ident and all records
 	// with 0 bits to cplmt
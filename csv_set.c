@@ -15,6 +15,15 @@
 #include <stdbool.h>
 #include "csv.h"
 
+// Memory-mapped set files are only supported on POSIX systems
+#if defined (unix) || defined (__unix) || defined (__unix__) || defined (__APPLE__)
+# define _CSV_MMAP_
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
 // Returns the empty set with the given size
 csv_set *csv_empty_set( int size ){
 	csv_set *empty_set;
@@ -22,7 +31,7 @@ csv_set *csv_empty_set( int size ){
 	empty_set = (csv_set *) malloc( sizeof( csv_set ) );
 	empty_set->size = size / 8 + (size % 8 ? 1 : 0);
 	// Don't add 1 byte if an exact multiple of 8
-	empty_set->bits = (uint8_t *) malloc( size );
+	empty_set->bits = (uint8_t *) malloc( empty_set->size );
 	for( i = 0; i < empty_set->size; i++ )
 		empty_set->bits[i] = 0x00;
 	return empty_set;
@@ -35,7 +44,7 @@ csv_set *csv_set_universe( int size ){
 	universe = (csv_set *) malloc( sizeof( csv_set ) );
 	universe->size = size / 8 + (size % 8 ? 1 : 0);
 	// Don't add 1 byte if an exact multiple of 8
-	universe->bits = (uint8_t *) malloc( size );
+	universe->bits = (uint8_t *) malloc( universe->size );
 	for( i = 0; i < universe->size; i++ )
 		universe->bits[i] = 0xff;
 	return universe;
@@ -147,20 +156,28 @@ csv_set *csv_set_intersection_f( csv_set *dst, csv_set *src ){
 	return dst;
 }
 
+// Digits used when writing a set in hexadecimal
+static const char hex_digits[] = "0123456789abcdef";
+
+// Converts a hexadecimal digit to its value without branching;
+// only valid for the characters 0-9, a-f and A-F
+#define hex_value( c ) (((c) & 0x0f) + 9 * ((c) >> 6))
+
 // Reads a set in hexadecimal from a string
 csv_set *csv_read_set( char *src ){
 	csv_set *dst;
 	int len;
 	int i;
-	char buf[3];
-	buf[2] = '\0'; // Makes sure sscanf() doesn't run off the end
+	uint8_t *bits;
 	len = strlen( src );
 	dst = (csv_set *) malloc( sizeof( csv_set ) );
 	dst->size = len / 2;
 	dst->bits = (uint8_t *) malloc( len / 2 );
-	for( i = 0; i < len; i += 2 ){
-		strncpy( buf, src+i, 2 );
-		dst->bits[(len-i)/2-1] = (uint8_t) strtol( buf, NULL, 16 );
+	// The string starts with the most significant byte, so
+	// fill the bit vector from the end
+	bits = dst->bits + dst->size;
+	for( i = 0; i + 1 < len; i += 2 ){
+		*--bits = (uint8_t) ((hex_value( (uint8_t) src[i] ) << 4) | hex_value( (uint8_t) src[i+1] ));
 	}
 	return dst;
 }
@@ -168,15 +185,17 @@ csv_set *csv_read_set( char *src ){
 // Writes a set in hexadecimal to a string
 char *csv_write_set( csv_set *src ){
 	char *dst;
+	char *ptr;
 	int i;
-	int len;
-	int hex;
-	len = src->size * 2;
-	dst = (char *) calloc( len + 1, 1 );
-	for( i = 0; i < len; i += 2 ){
-		hex = src->bits[(len-i)/2-1];
-		snprintf( dst+i, 3, "%s%x", (hex<0x10)?"0":"", hex );
+	uint8_t hex;
+	dst = (char *) malloc( src->size * 2 + 1 );
+	ptr = dst;
+	for( i = src->size - 1; i >= 0; i-- ){
+		hex = src->bits[i];
+		*ptr++ = hex_digits[hex >> 4];
+		*ptr++ = hex_digits[hex & 0x0f];
 	}
+	*ptr = '\0';
 	return dst;
 }
 
@@ -188,3 +207,255 @@ char *csv_write_set_f( csv_set *src ){
 	free( src );
 	return dst;
 }
+
+/*
+ * Binary set format:
+ *
+ * Offset  Size  Contents
+ * 0       4     Magic number "CSET"
+ * 4       1     Format version
+ * 5       1     Flags (CSV_SET_COMPRESSED if the payload is
+ *               run-length encoded)
+ * 6       2     Reserved, always zero
+ * 8       4     Size of the set in bytes (little-endian)
+ * 12      4     Size of the payload in bytes (little-endian)
+ * 16      ...   Payload
+ *
+ * The header is 16 bytes long so that the bit vector of an
+ * uncompressed file stays aligned when it is mapped into memory.
+ * Compressed payloads use PackBits run-length encoding, which
+ * works well on selection masks since they tend to consist of
+ * long runs of 0x00 and 0xff bytes.
+ */
+
+#define SET_MAGIC "CSET"
+#define SET_VERSION 1
+#define SET_HEADER_SIZE 16
+#define SET_CHUNK_SIZE 65536
+#define CSV_SET_COMPRESSED 0x01
+
+// Stores a 32-bit integer in little-endian byte order
+static void put_u32( uint8_t *dst, uint32_t n ){
+	dst[0] = n & 0xff;
+	dst[1] = (n >> 8) & 0xff;
+	dst[2] = (n >> 16) & 0xff;
+	dst[3] = (n >> 24) & 0xff;
+}
+
+// Loads a 32-bit integer stored in little-endian byte order
+static uint32_t get_u32( uint8_t *src ){
+	return (uint32_t) src[0] | ((uint32_t) src[1] << 8) | ((uint32_t) src[2] << 16) | ((uint32_t) src[3] << 24);
+}
+
+// Compresses up to SET_CHUNK_SIZE bytes of src with PackBits;
+// writes the result to dst if it is not NULL and returns the
+// compressed length. Sets *used to the number of source bytes
+// consumed. dst must have room for SET_CHUNK_SIZE + SET_CHUNK_SIZE / 128 + 1 bytes.
+static int packbits( uint8_t *src, int len, uint8_t *dst, int *used ){
+	int i, j, run, out;
+	out = 0;
+	i = 0;
+	while( i < len && out < SET_CHUNK_SIZE ){
+		// Measure the run of identical bytes starting at i
+		run = 1;
+		while( i + run < len && run < 128 && src[i+run] == src[i] )
+			run++;
+		if( run > 1 ){
+			if( dst ){
+				dst[out] = (uint8_t) (257 - run);
+				dst[out+1] = src[i];
+			}
+			out += 2;
+			i += run;
+		}
+		else{
+			// Literal run: extend until two identical bytes are found
+			j = i + 1;
+			while( j < len && j - i < 128 && !(j + 1 < len && src[j] == src[j+1]) )
+				j++;
+			if( dst ){
+				dst[out] = (uint8_t) (j - i - 1);
+				memcpy( dst + out + 1, src + i, j - i );
+			}
+			out += j - i + 1;
+			i = j;
+		}
+	}
+	*used = i;
+	return out;
+}
+
+// Writes a set to a file in the binary set format,
+// optionally compressing it; returns true on success
+bool csv_write_set_binary( FILE *fp, csv_set *set, bool compress ){
+	uint8_t header[SET_HEADER_SIZE];
+	uint8_t *buf;
+	uint32_t payload;
+	int pos, used, len;
+
+	// Compressed payloads need their length up front, so
+	// measure them in a first pass that produces no output
+	payload = set->size;
+	if( compress ){
+		payload = 0;
+		for( pos = 0; pos < set->size; pos += used )
+			payload += packbits( set->bits + pos, set->size - pos, NULL, &used );
+	}
+
+	memcpy( header, SET_MAGIC, 4 );
+	header[4] = SET_VERSION;
+	header[5] = compress ? CSV_SET_COMPRESSED : 0;
+	header[6] = header[7] = 0;
+	put_u32( header + 8, set->size );
+	put_u32( header + 12, payload );
+	if( fwrite( header, 1, SET_HEADER_SIZE, fp ) != SET_HEADER_SIZE )
+		return false;
+
+	if( !compress )
+		return fwrite( set->bits, 1, set->size, fp ) == (size_t) set->size;
+
+	// Stream the compressed payload out one chunk at a time
+	buf = (uint8_t *) malloc( SET_CHUNK_SIZE + SET_CHUNK_SIZE / 128 + 1 );
+	for( pos = 0; pos < set->size; pos += used ){
+		len = packbits( set->bits + pos, set->size - pos, buf, &used );
+		if( fwrite( buf, 1, len, fp ) != (size_t) len ){
+			free( buf );
+			return false;
+		}
+	}
+	free( buf );
+	return true;
+}
+
+// Reads a set in the binary set format from a file;
+// returns NULL if the file does not contain a valid set
+csv_set *csv_read_set_binary( FILE *fp ){
+	uint8_t header[SET_HEADER_SIZE];
+	uint8_t *buf;
+	csv_set *set;
+	uint32_t payload;
+	int c, n, pos, len, i;
+
+	if( fread( header, 1, SET_HEADER_SIZE, fp ) != SET_HEADER_SIZE )
+		return NULL;
+	if( memcmp( header, SET_MAGIC, 4 ) || header[4] != SET_VERSION )
+	// Error: Not a set file
+		return NULL;
+
+	set = (csv_set *) malloc( sizeof( csv_set ) );
+	set->size = get_u32( header + 8 );
+	payload = get_u32( header + 12 );
+	set->bits = (uint8_t *) malloc( set->size ? set->size : 1 );
+
+	if( !(header[5] & CSV_SET_COMPRESSED) ){
+		if( payload != (uint32_t) set->size || fread( set->bits, 1, set->size, fp ) != (size_t) set->size ){
+			free( set->bits );
+			free( set );
+			return NULL;
+		}
+		return set;
+	}
+
+	// Decode the PackBits payload chunk by chunk
+	buf = (uint8_t *) malloc( SET_CHUNK_SIZE );
+	pos = 0;
+	len = 0;
+	i = 0;
+	while( payload > 0 || i < len ){
+		if( len - i < 129 && payload > 0 ){
+			// Refill the buffer, keeping any partial control sequence
+			memmove( buf, buf + i, len - i );
+			len -= i;
+			i = 0;
+			n = fread( buf + len, 1, payload < (size_t) (SET_CHUNK_SIZE - len) ? (size_t) payload : (size_t) (SET_CHUNK_SIZE - len), fp );
+			if( n <= 0 )
+				break;
+			len += n;
+			payload -= n;
+		}
+		c = buf[i++];
+		if( c == 128 )
+		// No-op control byte
+			continue;
+		if( c < 128 ){
+			n = c + 1;
+			if( i + n > len || pos + n > set->size )
+				break;
+			memcpy( set->bits + pos, buf + i, n );
+			i += n;
+		}
+		else{
+			n = 257 - c;
+			if( i >= len || pos + n > set->size )
+				break;
+			memset( set->bits + pos, buf[i++], n );
+		}
+		pos += n;
+	}
+	free( buf );
+	if( pos != set->size ){
+	// Error: Truncated or corrupt payload
+		free( set->bits );
+		free( set );
+		return NULL;
+	}
+	return set;
+}
+
+#ifdef _CSV_MMAP_
+// Maps an uncompressed binary set file into memory; the set
+// must be released with csv_unmap_set(); returns NULL if the
+// file cannot be mapped
+csv_set *csv_map_set( char *path ){
+	uint8_t header[SET_HEADER_SIZE];
+	uint8_t *map;
+	struct stat st;
+	csv_set *set;
+	size_t size;
+	int fd;
+	fd = open( path, O_RDONLY );
+	if( fd < 0 )
+		return NULL;
+	if( read( fd, header, SET_HEADER_SIZE ) != SET_HEADER_SIZE || fstat( fd, &st ) < 0
+	    || memcmp( header, SET_MAGIC, 4 ) || header[4] != SET_VERSION || (header[5] & CSV_SET_COMPRESSED)
+	    || SET_HEADER_SIZE + (off_t) get_u32( header + 8 ) > st.st_size ){
+	// Error: Not an uncompressed set file
+		close( fd );
+		return NULL;
+	}
+	size = get_u32( header + 8 );
+	// Private mapping: modifying the set never touches the file
+	map = (uint8_t *) mmap( NULL, SET_HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( map == MAP_FAILED )
+		return NULL;
+	set = (csv_set *) malloc( sizeof( csv_set ) );
+	set->size = size;
+	set->bits = map + SET_HEADER_SIZE;
+	return set;
+}
+
+// Releases a set returned by csv_map_set()
+void csv_unmap_set( csv_set *set ){
+	munmap( set->bits - SET_HEADER_SIZE, set->size + SET_HEADER_SIZE );
+	free( set );
+}
+#else
+// Fallback for systems without mmap(): reads the whole file
+csv_set *csv_map_set( char *path ){
+	FILE *fp;
+	csv_set *set;
+	fp = fopen( path, "rb" );
+	if( !fp )
+		return NULL;
+	set = csv_read_set_binary( fp );
+	fclose( fp );
+	return set;
+}
+
+// Releases a set returned by csv_map_set()
+void csv_unmap_set( csv_set *set ){
+	free( set->bits );
+	free( set );
+}
+#endif
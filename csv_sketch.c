@@ -0,0 +1,540 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Approximate summaries of   *
+ *                 fields                     *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
+
+/*
+ * Quantiles are estimated with a KLL sketch: a stack of compactors,
+ * where every value kept at level h stands for 2^h values. New
+ * values go to level 0. When the sketch holds more values than its
+ * capacity, the lowest full level is sorted and every other value,
+ * starting at a random offset, moves up one level while the rest
+ * are dropped. The capacity of a level shrinks by a factor of 2/3
+ * for each level below the top one, so the sketch keeps O(k) values
+ * and the rank error stays around 1.7 / k whatever the number of
+ * values added.
+ *
+ * Distinct values are counted with HyperLogLog++: each value is
+ * hashed with csv_hash_cell() into 64 bits, whose first HLL_PRECISION
+ * bits select a register that keeps the longest run of leading zeros
+ * seen in the remaining bits. Until the counter holds HLL_SPARSE
+ * distinct hashes, it keeps the hashes themselves in a small hash set
+ * and counts them exactly. Dense estimates up to HLL_THRESHOLD are
+ * replaced by linear counting of the empty registers, as in the
+ * original HyperLogLog.
+ *
+ * Sketches, histograms and counters built over separate parts of the
+ * data can be merged, so a table is summarized one chunk of zones per
+ * thread and the results are merged in table order.
+ */
+
+struct _csv_sketch {
+	int k;           // Capacity of the top level
+	int nlevels;
+	double **levels; // Values kept at each level
+	int *sizes;      // # of values kept at each level
+	int *allocs;     // Allocated size of each level
+	int size;        // # of values kept at all levels
+	int capacity;    // # of values kept before compacting
+	int64_t count;   // # of values added
+	double min;
+	double max;
+	uint64_t seed;   // State of the coin used by compactions
+};
+
+// Creates an empty sketch; k sets the accuracy, CSV_SKETCH_K if it
+// is not positive
+csv_sketch *csv_create_sketch( int k ){
+	csv_sketch *sketch;
+	sketch = (csv_sketch *) calloc( 1, sizeof( csv_sketch ) );
+	sketch->k = k > 0 ? k : CSV_SKETCH_K;
+	sketch->seed = 0x9e3779b97f4a7c15ULL;
+	return sketch;
+}
+
+// Frees a sketch
+void csv_free_sketch( csv_sketch *sketch ){
+	int h;
+	for( h = 0; h < sketch->nlevels; h++ )
+		free( sketch->levels[h] );
+	free( sketch->levels );
+	free( sketch->sizes );
+	free( sketch->allocs );
+	free( sketch );
+}
+
+// Capacity of level h of a sketch
+static int level_capacity( csv_sketch *sketch, int h ){
+	int cap, d;
+	cap = sketch->k;
+	for( d = sketch->nlevels - 1 - h; d > 0 && cap > 2; d-- )
+		cap = cap * 2 / 3;
+	return cap > 2 ? cap : 2;
+}
+
+// Adds an empty level on top of a sketch
+static void add_level( csv_sketch *sketch ){
+	int h;
+	h = sketch->nlevels++;
+	sketch->levels = (double **) realloc( sketch->levels, sketch->nlevels * sizeof( double * ) );
+	sketch->sizes = (int *) realloc( sketch->sizes, sketch->nlevels * sizeof( int ) );
+	sketch->allocs = (int *) realloc( sketch->allocs, sketch->nlevels * sizeof( int ) );
+	sketch->levels[h] = NULL;
+	sketch->sizes[h] = 0;
+	sketch->allocs[h] = 0;
+	sketch->capacity = 0;
+	for( h = 0; h < sketch->nlevels; h++ )
+		sketch->capacity += level_capacity( sketch, h );
+}
+
+// Appends a value to level h of a sketch
+static void push_value( csv_sketch *sketch, int h, double x ){
+	if( sketch->sizes[h] == sketch->allocs[h] ){
+		sketch->allocs[h] = sketch->allocs[h] ? 2 * sketch->allocs[h] : 16;
+		sketch->levels[h] = (double *) realloc( sketch->levels[h], sketch->allocs[h] * sizeof( double ) );
+	}
+	sketch->levels[h][sketch->sizes[h]++] = x;
+	sketch->size++;
+}
+
+// Orders doubles for qsort()
+static int compare_doubles( const void *a, const void *b ){
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+// Compacts the lowest full level of a sketch until it is within its
+// capacity
+static void compact( csv_sketch *sketch ){
+	double *level;
+	int h, i, n, even, offset;
+	while( sketch->size > sketch->capacity ){
+		for( h = 0; h < sketch->nlevels - 1; h++ ){
+			if( sketch->sizes[h] >= level_capacity( sketch, h ) )
+				break;
+		}
+		if( h == sketch->nlevels - 1 )
+			add_level( sketch );
+		level = sketch->levels[h];
+		n = sketch->sizes[h];
+		qsort( level, n, sizeof( double ), compare_doubles );
+		// xorshift64 supplies the coin
+		sketch->seed ^= sketch->seed << 13;
+		sketch->seed ^= sketch->seed >> 7;
+		sketch->seed ^= sketch->seed << 17;
+		offset = (int) (sketch->seed & 1);
+		// An odd value out stays behind
+		even = n & ~1;
+		for( i = offset; i < even; i += 2 )
+			push_value( sketch, h + 1, level[i] );
+		sketch->size -= n;
+		if( n & 1 ){
+			level[0] = level[n-1];
+			sketch->sizes[h] = 1;
+			sketch->size++;
+		}
+		else
+			sketch->sizes[h] = 0;
+	}
+}
+
+// Adds a value to a sketch; NaN is ignored
+void csv_sketch_add( csv_sketch *sketch, double x ){
+	if( x != x )
+		return;
+	if( !sketch->nlevels )
+		add_level( sketch );
+	if( !sketch->count || x < sketch->min )
+		sketch->min = x;
+	if( !sketch->count || x > sketch->max )
+		sketch->max = x;
+	sketch->count++;
+	push_value( sketch, 0, x );
+	if( sketch->size > sketch->capacity )
+		compact( sketch );
+}
+
+// Adds the values of src to dst; src is left alone
+void csv_sketch_merge( csv_sketch *dst, csv_sketch *src ){
+	int h, i;
+	if( !src->count )
+		return;
+	while( dst->nlevels < src->nlevels )
+		add_level( dst );
+	for( h = 0; h < src->nlevels; h++ ){
+		for( i = 0; i < src->sizes[h]; i++ )
+			push_value( dst, h, src->levels[h][i] );
+	}
+	if( !dst->count || src->min < dst->min )
+		dst->min = src->min;
+	if( !dst->count || src->max > dst->max )
+		dst->max = src->max;
+	dst->count += src->count;
+	compact( dst );
+}
+
+// Returns the number of values added to a sketch
+int64_t csv_sketch_count( csv_sketch *sketch ){
+	return sketch->count;
+}
+
+// Value kept by a sketch and the number of values it stands for
+typedef struct {
+	double x;
+	int64_t weight;
+} weighted_value;
+
+// Orders weighted values for qsort()
+static int compare_weighted( const void *a, const void *b ){
+	return compare_doubles( &((const weighted_value *) a)->x, &((const weighted_value *) b)->x );
+}
+
+// Estimates the q-quantile of the values added to a sketch, for q
+// between 0 and 1: 0 gives the minimum, 0.5 the median and 1 the
+// maximum; returns 0 for an empty sketch
+double csv_sketch_quantile( csv_sketch *sketch, double q ){
+	weighted_value *items;
+	int64_t total, rank;
+	double x;
+	int h, i, n;
+	if( !sketch->count )
+		return 0;
+	if( q <= 0 )
+		return sketch->min;
+	if( q >= 1 )
+		return sketch->max;
+	items = (weighted_value *) malloc( sketch->size * sizeof( weighted_value ) );
+	n = 0;
+	total = 0;
+	for( h = 0; h < sketch->nlevels; h++ ){
+		for( i = 0; i < sketch->sizes[h]; i++ ){
+			items[n].x = sketch->levels[h][i];
+			items[n].weight = (int64_t) 1 << h;
+			total += items[n++].weight;
+		}
+	}
+	qsort( items, n, sizeof( weighted_value ), compare_weighted );
+	// First value whose cumulative weight reaches the rank
+	rank = (int64_t) (q * total);
+	x = items[n-1].x;
+	for( i = 0; i < n; i++ ){
+		rank -= items[i].weight;
+		if( rank < 0 ){
+			x = items[i].x;
+			break;
+		}
+	}
+	free( items );
+	return x;
+}
+
+// Creates a histogram of nbins bins of equal width between lo and hi;
+// returns NULL if there are no bins or hi is not above lo
+csv_histogram *csv_create_histogram( double lo, double hi, int nbins ){
+	csv_histogram *hist;
+	if( nbins < 1 || !(hi > lo) )
+	// Error: Invalid bins
+		return NULL;
+	hist = (csv_histogram *) calloc( 1, sizeof( csv_histogram ) );
+	hist->lo = lo;
+	hist->hi = hi;
+	hist->nbins = nbins;
+	hist->bins = (int64_t *) calloc( nbins, sizeof( int64_t ) );
+	return hist;
+}
+
+// Frees a histogram
+void csv_free_histogram( csv_histogram *hist ){
+	free( hist->bins );
+	free( hist );
+}
+
+// Adds a value to a histogram; NaN is ignored
+void csv_histogram_add( csv_histogram *hist, double x ){
+	int bin;
+	if( x != x )
+		return;
+	if( x < hist->lo )
+		hist->below++;
+	else if( x >= hist->hi )
+		hist->above++;
+	else{
+		bin = (int) ((x - hist->lo) / (hist->hi - hist->lo) * hist->nbins);
+		// Rounding can push values just below hi out of range
+		hist->bins[bin < hist->nbins ? bin : hist->nbins - 1]++;
+	}
+}
+
+// Adds the counts of src to dst; returns false if their bins differ
+bool csv_histogram_merge( csv_histogram *dst, csv_histogram *src ){
+	int i;
+	if( dst->lo != src->lo || dst->hi != src->hi || dst->nbins != src->nbins )
+	// Error: Bins differ
+		return false;
+	for( i = 0; i < dst->nbins; i++ )
+		dst->bins[i] += src->bins[i];
+	dst->below += src->below;
+	dst->above += src->above;
+	return true;
+}
+
+// # of bits of a hash that select a register, for an error of about
+// 1.04 / sqrt( 2^HLL_PRECISION ) = 0.8%
+#define HLL_PRECISION 14
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+// Raw estimates up to this many distinct values, 2.5 times the number
+// of registers, are biased; without the bias tables of HyperLogLog++,
+// linear counting is used instead as long as some register is empty
+#define HLL_THRESHOLD (5 * HLL_REGISTERS / 2)
+
+// # of hashes a counter keeps before switching to registers, and the
+// size of the hash set holding them
+#define HLL_SPARSE 2048
+#define HLL_SLOTS (2 * HLL_SPARSE)
+
+struct _csv_hll {
+	uint64_t *hashes;   // Hash set of the hashes seen, 0 for empty slots,
+	int nhashes;        // or NULL once the counter uses registers
+	uint8_t *registers;
+};
+
+// Creates an empty distinct counter
+csv_hll *csv_create_hll( void ){
+	csv_hll *hll;
+	hll = (csv_hll *) calloc( 1, sizeof( csv_hll ) );
+	hll->hashes = (uint64_t *) calloc( HLL_SLOTS, sizeof( uint64_t ) );
+	return hll;
+}
+
+// Frees a distinct counter
+void csv_free_hll( csv_hll *hll ){
+	free( hll->hashes );
+	free( hll->registers );
+	free( hll );
+}
+
+// Updates the register selected by a hash
+static void set_register( uint8_t *registers, uint64_t hash ){
+	uint64_t rest;
+	uint8_t rank;
+	rest = hash << HLL_PRECISION;
+	// Position of the first 1 bit, past the end if there is none
+	rank = 1;
+	while( rank <= 64 - HLL_PRECISION && !(rest & 0x8000000000000000ULL) ){
+		rest <<= 1;
+		rank++;
+	}
+	if( rank > registers[hash >> (64 - HLL_PRECISION)] )
+		registers[hash >> (64 - HLL_PRECISION)] = rank;
+}
+
+// Moves the hashes of a counter into registers
+static void densify( csv_hll *hll ){
+	int i;
+	hll->registers = (uint8_t *) calloc( HLL_REGISTERS, 1 );
+	for( i = 0; i < HLL_SLOTS; i++ ){
+		if( hll->hashes[i] )
+			set_register( hll->registers, hll->hashes[i] );
+	}
+	free( hll->hashes );
+	hll->hashes = NULL;
+}
+
+// Adds a hash to a counter
+static void add_hash( csv_hll *hll, uint64_t hash ){
+	int slot;
+	if( hll->hashes ){
+		// 0 marks empty slots
+		if( !hash )
+			hash = 1;
+		slot = (int) (hash & (HLL_SLOTS - 1));
+		while( hll->hashes[slot] && hll->hashes[slot] != hash )
+			slot = (slot + 1) & (HLL_SLOTS - 1);
+		if( hll->hashes[slot] )
+			return;
+		hll->hashes[slot] = hash;
+		if( ++hll->nhashes <= HLL_SPARSE )
+			return;
+		densify( hll );
+		return;
+	}
+	set_register( hll->registers, hash );
+}
+
+// Adds the len bytes of a value to a distinct counter
+void csv_hll_add( csv_hll *hll, const void *value, size_t len ){
+	add_hash( hll, csv_hash_bytes( value, len ) );
+}
+
+// Adds the value of field f of a table to a distinct counter; equal
+// values are counted once even if they are stored differently
+void csv_hll_add_cell( csv_hll *hll, csv_table *table, int f, void *cell ){
+	add_hash( hll, csv_hash_cell( table, f, cell ) );
+}
+
+// Adds the values counted by src to dst; src is left alone
+void csv_hll_merge( csv_hll *dst, csv_hll *src ){
+	int i;
+	if( src->hashes ){
+		for( i = 0; i < HLL_SLOTS; i++ ){
+			if( src->hashes[i] )
+				add_hash( dst, src->hashes[i] );
+		}
+		return;
+	}
+	if( dst->hashes )
+		densify( dst );
+	for( i = 0; i < HLL_REGISTERS; i++ ){
+		if( src->registers[i] > dst->registers[i] )
+			dst->registers[i] = src->registers[i];
+	}
+}
+
+// Estimates the number of distinct values added to a counter
+int64_t csv_hll_count( csv_hll *hll ){
+	double sum, estimate;
+	int i, zeros;
+	if( hll->hashes )
+		return hll->nhashes;
+	sum = 0;
+	zeros = 0;
+	for( i = 0; i < HLL_REGISTERS; i++ ){
+		sum += 1.0 / ((uint64_t) 1 << hll->registers[i]);
+		zeros += !hll->registers[i];
+	}
+	estimate = 0.7213 / (1 + 1.079 / HLL_REGISTERS) * HLL_REGISTERS * HLL_REGISTERS / sum;
+	if( zeros && estimate <= HLL_THRESHOLD )
+	// Linear counting of the empty registers
+		estimate = HLL_REGISTERS * log( (double) HLL_REGISTERS / zeros );
+	return (int64_t) (estimate + 0.5);
+}
+
+// State shared by the workers of a summary
+typedef struct {
+	csv_table *table;
+	int field;
+	csv_converter conv;
+	int nchunks;
+	csv_record *first[CSV_MAX_THREADS]; // First record of each chunk
+	int count[CSV_MAX_THREADS];         // # of records in each chunk
+	csv_sketch *sketches[CSV_MAX_THREADS];
+	csv_histogram *hists[CSV_MAX_THREADS];
+	csv_hll *hlls[CSV_MAX_THREADS];
+} sketch_job;
+
+// Summarizes the records of chunks lo through hi - 1
+static void sketch_chunks( void *arg, int lo, int hi ){
+	sketch_job *job = (sketch_job *) arg;
+	csv_record *rec;
+	double x;
+	int c, i;
+	for( c = lo; c < hi; c++ ){
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next ){
+			x = csv_convert_cell( &job->conv, rec->record[job->field] );
+			if( job->sketches[c] )
+				csv_sketch_add( job->sketches[c], x );
+			if( job->hists[c] )
+				csv_histogram_add( job->hists[c], x );
+		}
+	}
+}
+
+// Adds the values of the number, int64 or double field given by name
+// to a sketch and a histogram, either of which may be NULL; returns
+// false if the field does not exist or is a string field
+bool csv_column_sketch( csv_table *table, char *column, csv_sketch *sketch, csv_histogram *hist ){
+	sketch_job *job;
+	int f, c;
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, column ) )
+			break;
+	}
+	if( f == table->rlen || table->header[f]->type == csv_string )
+	// Error: Name not found or type mismatch
+		return false;
+	job = (sketch_job *) calloc( 1, sizeof( sketch_job ) );
+	job->field = f;
+	csv_prepare_converter( table, f, &job->conv );
+	job->nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	// Each chunk fills sketches of its own
+	for( c = 0; c < job->nchunks; c++ ){
+		if( sketch )
+			job->sketches[c] = csv_create_sketch( sketch->k );
+		if( hist )
+			job->hists[c] = csv_create_histogram( hist->lo, hist->hi, hist->nbins );
+	}
+	csv_parallel_for( job->nchunks, sketch_chunks, job );
+	for( c = 0; c < job->nchunks; c++ ){
+		if( sketch ){
+			csv_sketch_merge( sketch, job->sketches[c] );
+			csv_free_sketch( job->sketches[c] );
+		}
+		if( hist ){
+			csv_histogram_merge( hist, job->hists[c] );
+			csv_free_histogram( job->hists[c] );
+		}
+	}
+	free( job );
+	return true;
+}
+
+// Counts the distinct values of the records of chunks lo through hi - 1
+static void count_chunks( void *arg, int lo, int hi ){
+	sketch_job *job = (sketch_job *) arg;
+	csv_record *rec;
+	int c, i;
+	for( c = lo; c < hi; c++ ){
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next )
+			csv_hll_add_cell( job->hlls[c], job->table, job->field, rec->record[job->field] );
+	}
+}
+
+// Estimates the number of distinct values of the field given by name
+// without storing them; returns -1 if the field does not exist
+int64_t csv_approx_distinct( csv_table *table, char *column ){
+	sketch_job *job;
+	csv_hll *hll;
+	int64_t count;
+	int f, c;
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, column ) )
+			break;
+	}
+	if( f == table->rlen )
+	// Error: Name not found
+		return -1;
+	job = (sketch_job *) calloc( 1, sizeof( sketch_job ) );
+	job->table = table;
+	job->field = f;
+	job->nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	// Each chunk fills registers of its own
+	for( c = 0; c < job->nchunks; c++ )
+		job->hlls[c] = csv_create_hll();
+	csv_parallel_for( job->nchunks, count_chunks, job );
+	hll = csv_create_hll();
+	for( c = 0; c < job->nchunks; c++ ){
+		csv_hll_merge( hll, job->hlls[c] );
+		csv_free_hll( job->hlls[c] );
+	}
+	count = csv_hll_count( hll );
+	csv_free_hll( hll );
+	free( job );
+	return count;
+}
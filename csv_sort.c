@@ -0,0 +1,465 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Implementation of SQL      *
+ *                 ORDER BY clause            *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
+#include "sort.h"
+
+/*
+ * Tables are sorted by relinking their records; the cells never
+ * move. The records are gathered into an array and sorted one key
+ * at a time, starting with the last key, by a stable sort, which
+ * leaves them ordered by all the keys at the end.
+ *
+ * Each key is encoded as an unsigned 64-bit integer whose order is
+ * the order of the key and sorted with an LSD radix sort:
+ *
+ * - Numbers are scaled to the smallest exponent in the column and
+ *   have their sign bit flipped. Columns whose exponents are too far
+ *   apart to be scaled into 64 bits use a merge sort instead.
+ * - Int64 fields have their sign bit flipped. Doubles have it set
+ *   if they are positive and all their bits inverted otherwise.
+ * - Strings are encoded by their first eight bytes. Runs of records
+ *   that share a full eight-byte prefix are then merge sorted with
+ *   strcmp().
+ *
+ * Descending keys invert the encoded value or the comparison.
+ */
+
+// Record with the encoded value of the key being sorted on
+typedef struct {
+	uint64_t key;
+	csv_record *rec;
+} sort_item;
+
+// Compares two records by a field, in the given direction
+static int compare_field( csv_table *table, int f, enum directions dir, csv_record *a, csv_record *b ){
+	int c;
+	c = csv_compare_cells( table->header[f]->type, a->record[f], b->record[f] );
+	return dir == DESC ? -c : c;
+}
+
+// Stable merge sort of n items by field f
+static void merge_sort( csv_table *table, int f, enum directions dir, sort_item *items, sort_item *tmp, int n ){
+	sort_item *src, *dst, *swap;
+	int width, lo, mid, hi, i, j, k;
+	src = items;
+	dst = tmp;
+	for( width = 1; width < n; width <<= 1 ){
+		for( lo = 0; lo < n; lo += 2 * width ){
+			mid = lo + width < n ? lo + width : n;
+			hi = lo + 2 * width < n ? lo + 2 * width : n;
+			i = lo;
+			j = mid;
+			k = lo;
+			while( i < mid && j < hi ){
+				if( compare_field( table, f, dir, src[j].rec, src[i].rec ) < 0 )
+					dst[k++] = src[j++];
+				else
+					dst[k++] = src[i++];
+			}
+			while( i < mid )
+				dst[k++] = src[i++];
+			while( j < hi )
+				dst[k++] = src[j++];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if( src != items )
+		memcpy( items, src, n * sizeof( sort_item ) );
+}
+
+// Stable LSD radix sort of n items by their encoded keys, one byte
+// at a time; bytes that are the same in every key are skipped
+static void radix_sort( sort_item *items, sort_item *tmp, int n ){
+	sort_item *src, *dst, *swap;
+	int count[256];
+	int shift, i, d, sum, c;
+	src = items;
+	dst = tmp;
+	for( shift = 0; shift < 64; shift += 8 ){
+		memset( count, 0, sizeof( count ) );
+		for( i = 0; i < n; i++ )
+			count[(src[i].key >> shift) & 0xff]++;
+		if( count[(src[0].key >> shift) & 0xff] == n )
+			continue;
+		for( sum = 0, d = 0; d < 256; d++ ){
+			c = count[d];
+			count[d] = sum;
+			sum += c;
+		}
+		for( i = 0; i < n; i++ )
+			dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if( src != items )
+		memcpy( items, src, n * sizeof( sort_item ) );
+}
+
+// Encodes a number field scaled to the exponent emin; returns false
+// if the exponents of the column are too far apart to do so
+static bool encode_numbers( sort_item *items, int n, int f, enum directions dir ){
+	dfloat64_t *val;
+	int64_t v;
+	int32_t emin, emax;
+	bool seen;
+	int i;
+	emin = emax = 0;
+	seen = false;
+	// Zeros can take any exponent, so they are left out
+	for( i = 0; i < n; i++ ){
+		val = (dfloat64_t *) items[i].rec->record[f];
+		if( !val->mantissa )
+			continue;
+		if( !seen ){
+			emin = emax = val->exponent;
+			seen = true;
+		}
+		if( val->exponent < emin )
+			emin = val->exponent;
+		if( val->exponent > emax )
+			emax = val->exponent;
+	}
+	if( (int64_t) emax - emin > KERNEL_MAX_SCALE )
+		return false;
+	for( i = 0; i < n; i++ ){
+		val = (dfloat64_t *) items[i].rec->record[f];
+		v = val->mantissa ? val->mantissa * csv_pow10[val->exponent - emin] : 0;
+		items[i].key = (uint64_t) v ^ 0x8000000000000000ULL;
+		if( dir == DESC )
+			items[i].key = ~items[i].key;
+	}
+	return true;
+}
+
+// Encodes the first eight bytes of a string field, most significant
+// byte first, so that the keys order like strcmp()
+static void encode_strings( sort_item *items, int n, int f, enum directions dir ){
+	unsigned char *str;
+	uint64_t key;
+	int i, j;
+	for( i = 0; i < n; i++ ){
+		str = (unsigned char *) items[i].rec->record[f];
+		key = 0;
+		for( j = 0; j < 8; j++ ){
+			key = (key << 8) | *str;
+			if( *str )
+				str++;
+		}
+		items[i].key = dir == DESC ? ~key : key;
+	}
+}
+
+// Encodes int64 and double fields, which always fit the key: the
+// sign bit of an integer is flipped, and so is the sign bit of a
+// positive double, while every bit of a negative double is inverted;
+// every NaN gets the largest key, as in csv_compare_cells()
+static void encode_natives( sort_item *items, int n, int f, enum types type, enum directions dir ){
+	uint64_t key;
+	double d;
+	int i;
+	for( i = 0; i < n; i++ ){
+		if( type == csv_int64 )
+			key = (uint64_t) *(int64_t *) items[i].rec->record[f] ^ 0x8000000000000000ULL;
+		else{
+			// -0.0 sorts with 0.0
+			d = *(double *) items[i].rec->record[f];
+			if( d == 0 )
+				d = 0;
+			memcpy( &key, &d, sizeof( uint64_t ) );
+			key = (key & 0x8000000000000000ULL) ? ~key : key | 0x8000000000000000ULL;
+			// NaNs of either sign sort last and together
+			if( d != d )
+				key = ~0ULL;
+		}
+		items[i].key = dir == DESC ? ~key : key;
+	}
+}
+
+// Sorts items stably by field f
+static void sort_items( csv_table *table, int f, enum directions dir, sort_item *items, sort_item *tmp, int n ){
+	int i, j;
+	if( table->header[f]->type == csv_number ){
+		if( encode_numbers( items, n, f, dir ) )
+			radix_sort( items, tmp, n );
+		else
+			merge_sort( table, f, dir, items, tmp, n );
+		return;
+	}
+	if( table->header[f]->type == csv_int64 || table->header[f]->type == csv_double ){
+		encode_natives( items, n, f, table->header[f]->type, dir );
+		radix_sort( items, tmp, n );
+		return;
+	}
+	encode_strings( items, n, f, dir );
+	radix_sort( items, tmp, n );
+	// Strings whose prefixes fill all eight bytes may still differ
+	for( i = 0; i < n; i = j ){
+		for( j = i + 1; j < n && items[j].key == items[i].key; j++ );
+		if( j - i > 1 && strlen( (char *) items[i].rec->record[f] ) >= 8 )
+			merge_sort( table, f, dir, items + i, tmp, j - i );
+	}
+}
+
+// Sorts an array of n records of a table by nkeys fields in the
+// given directions, the first key being the most significant
+void csv_sort_records( csv_table *table, int nkeys, int *fields, enum directions *directions, csv_record **recs, int n ){
+	sort_item *items, *tmp;
+	int i;
+	if( n < 2 )
+		return;
+	items = (sort_item *) malloc( n * sizeof( sort_item ) );
+	tmp = (sort_item *) malloc( n * sizeof( sort_item ) );
+	for( i = 0; i < n; i++ )
+		items[i].rec = recs[i];
+	for( i = nkeys - 1; i >= 0; i-- )
+		sort_items( table, fields[i], directions[i], items, tmp, n );
+	for( i = 0; i < n; i++ )
+		recs[i] = items[i].rec;
+	free( items );
+	free( tmp );
+}
+
+// Equivalent to ORDER BY in SQL; sorts the records of a table by
+// nkeys fields in the given directions, the first key being the
+// most significant; returns false if a field does not exist
+bool csv_sort_table( csv_table *table, int nkeys, char **keys, enum directions *directions ){
+	csv_record **recs;
+	csv_record *rec;
+	csv_index *index;
+	int *fields;
+	int i, f, n, nindexes;
+	char **names;
+
+	fields = (int *) malloc( (nkeys ? nkeys : 1) * sizeof( int ) );
+	for( i = 0; i < nkeys; i++ ){
+		for( f = 0; f < table->rlen; f++ ){
+			if( !strcmp( table->header[f]->name, keys[i] ) )
+				break;
+		}
+		if( f == table->rlen ){
+		// Error: Name not found
+			free( fields );
+			return false;
+		}
+		fields[i] = f;
+	}
+
+	n = csv_count_records( table );
+	recs = (csv_record **) malloc( (n ? n : 1) * sizeof( csv_record * ) );
+	i = 0;
+	for( rec = table->start->next; rec; rec = rec->next )
+		recs[i++] = rec;
+	csv_sort_records( table, nkeys, fields, directions, recs, n );
+
+	// Relink and renumber the records
+	rec = table->start;
+	for( i = 0; i < n; i++ ){
+		rec->next = recs[i];
+		rec = rec->next;
+		rec->row = i;
+	}
+	rec->next = NULL;
+	free( recs );
+	free( fields );
+
+	// Rows have changed, so rebuild the indexes and the zone map
+	nindexes = 0;
+	for( index = table->indexes; index; index = index->next )
+		nindexes++;
+	names = (char **) malloc( (nindexes ? nindexes : 1) * sizeof( char * ) );
+	i = 0;
+	for( index = table->indexes; index; index = index->next )
+		names[i++] = table->header[index->field]->name;
+	csv_drop_indexes( table );
+	for( i = 0; i < nindexes; i++ )
+		csv_create_index( table, names[i] );
+	free( names );
+	csv_analyze_table( table );
+	return true;
+}
+
+// Top-k selection spread over chunks of a table
+typedef struct {
+	csv_table *table;
+	int field;
+	enum directions dir;
+	int k;
+	csv_record *first[CSV_MAX_THREADS]; // First record of each chunk
+	int count[CSV_MAX_THREADS];         // # of records in each chunk
+	csv_record **heaps;                 // k heap slots for each chunk
+	int sizes[CSV_MAX_THREADS];         // # of records in each heap
+} top_job;
+
+// Returns true if record a ranks before record b; ties go to the
+// earlier row so that the result does not depend on the threads
+static bool ranks_before( top_job *job, csv_record *a, csv_record *b ){
+	int c;
+	c = compare_field( job->table, job->field, job->dir, a, b );
+	return c < 0 || (c == 0 && a->row < b->row);
+}
+
+// Offers a record to a heap of at most k records whose root is the
+// lowest-ranked record kept so far
+static void heap_offer( top_job *job, csv_record **heap, int *size, csv_record *rec ){
+	csv_record *swap;
+	int i, child;
+	if( *size < job->k ){
+		// Sift the new record up
+		i = (*size)++;
+		heap[i] = rec;
+		while( i > 0 && ranks_before( job, heap[(i-1)/2], heap[i] ) ){
+			swap = heap[i];
+			heap[i] = heap[(i-1)/2];
+			heap[(i-1)/2] = swap;
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+	if( !ranks_before( job, rec, heap[0] ) )
+		return;
+	// Replace the root and sift it down
+	heap[0] = rec;
+	i = 0;
+	while( (child = 2 * i + 1) < *size ){
+		if( child + 1 < *size && ranks_before( job, heap[child], heap[child+1] ) )
+			child++;
+		if( !ranks_before( job, heap[i], heap[child] ) )
+			break;
+		swap = heap[i];
+		heap[i] = heap[child];
+		heap[child] = swap;
+		i = child;
+	}
+}
+
+// Keeps the k best records of chunks lo through hi - 1 in the
+// heaps of those chunks
+static void top_chunks( void *arg, int lo, int hi ){
+	top_job *job = (top_job *) arg;
+	csv_record *rec;
+	int c, i;
+	for( c = lo; c < hi; c++ ){
+		rec = job->first[c];
+		job->sizes[c] = 0;
+		for( i = 0; i < job->count[c]; i++, rec = rec->next )
+			heap_offer( job, job->heaps + (size_t) c * job->k, job->sizes + c, rec );
+	}
+}
+
+// Creates a set type indexing the k records of a table with the
+// smallest (ASC) or largest (DESC) values of the field given by
+// name, without sorting the table; ties are broken by row. Returns
+// NULL if the field does not exist.
+csv_set *csv_top_k( csv_table *table, char *name, int k, enum directions direction ){
+	top_job *job;
+	csv_record **heap;
+	csv_set *subset;
+	int f, c, i, n, size, nchunks;
+	for( f = 0; f < table->rlen; f++ ){
+		if( !strcmp( table->header[f]->name, name ) )
+			break;
+	}
+	if( f == table->rlen )
+	// Error: Name not found
+		return NULL;
+	n = table->zcount ? csv_zone_rows( table ) : csv_count_records( table );
+	subset = csv_empty_set( n );
+	if( k >= n ){
+		csv_fill_bits( subset->bits, n );
+		return subset;
+	}
+	if( k <= 0 )
+		return subset;
+
+	// Each chunk keeps its own k best records, which are then
+	// merged into a single heap
+	job = (top_job *) malloc( sizeof( top_job ) );
+	job->table = table;
+	job->field = f;
+	job->dir = direction;
+	job->k = k;
+	nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	job->heaps = (csv_record **) malloc( (size_t) nchunks * k * sizeof( csv_record * ) );
+	csv_parallel_for( nchunks, top_chunks, job );
+
+	heap = (csv_record **) malloc( k * sizeof( csv_record * ) );
+	size = 0;
+	for( c = 0; c < nchunks; c++ ){
+		for( i = 0; i < job->sizes[c]; i++ )
+			heap_offer( job, heap, &size, job->heaps[(size_t) c * k + i] );
+	}
+	for( i = 0; i < size; i++ )
+		csv_set_add( subset, heap[i]->row );
+	free( heap );
+	free( job->heaps );
+	free( job );
+	return subset;
+}
+
+// Same as csv_distinct(), but finds the distinct combinations by
+// sorting an array of the records instead of building hash tables
+// of groups, which uses less memory when most records are distinct;
+// the table itself is not reordered
+csv_set *csv_distinct_sorted( csv_table *table, int ncols, char **columns ){
+	sort_item *items, *tmp;
+	csv_record *rec;
+	csv_set *subset;
+	int *fields;
+	int i, j, f, n;
+
+	fields = (int *) malloc( (ncols ? ncols : 1) * sizeof( int ) );
+	for( i = 0; i < ncols; i++ ){
+		for( f = 0; f < table->rlen; f++ ){
+			if( !strcmp( table->header[f]->name, columns[i] ) )
+				break;
+		}
+		if( f == table->rlen ){
+		// Error: Name not found
+			free( fields );
+			return NULL;
+		}
+		fields[i] = f;
+	}
+
+	n = csv_count_records( table );
+	subset = csv_empty_set( table->zcount ? csv_zone_rows( table ) : n );
+	items = (sort_item *) malloc( (n ? n : 1) * sizeof( sort_item ) );
+	tmp = (sort_item *) malloc( (n ? n : 1) * sizeof( sort_item ) );
+	i = 0;
+	for( rec = table->start->next; rec; rec = rec->next )
+		items[i++].rec = rec;
+	for( i = ncols - 1; i >= 0 && n > 1; i-- )
+		sort_items( table, fields[i], ASC, items, tmp, n );
+
+	// The sort is stable, so the first record of each run of equal
+	// keys is the first occurrence
+	for( i = 0; i < n; i++ ){
+		for( j = 0; j < ncols && i; j++ ){
+			if( compare_field( table, fields[j], ASC, items[i-1].rec, items[i].rec ) )
+				break;
+		}
+		if( !i || j < ncols )
+			csv_set_add( subset, items[i].rec->row );
+	}
+	free( items );
+	free( tmp );
+	free( fields );
+	return subset;
+}
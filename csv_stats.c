@@ -0,0 +1,206 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Descriptive statistics     *
+ *                 of number fields           *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "kernels.h"
+#include "zone.h"
+
+/*
+ * Statistics are computed in a single scan of the table, split into
+ * chunks of whole zones, one thread per chunk. Each chunk converts
+ * the values of every requested field to doubles and gathers them
+ * into one block per field. A full block is summarized by plain
+ * loops over a contiguous array, which the compiler can vectorize:
+ * one loop for the sum, minimum and maximum, and one for the squared
+ * deviations from the block mean. Summaries are combined with the
+ * parallel form of Welford's algorithm, first block by block within
+ * a chunk and then chunk by chunk in table order.
+ */
+
+// Running statistics of a field
+typedef struct {
+	int count;
+	int invalid;
+	double min;
+	double max;
+	double mean;
+	double m2;   // Sum of squared deviations from the mean
+} stats_state;
+
+// State shared by the workers of a scan
+typedef struct {
+	csv_table *table;
+	int ncols;
+	int *fields;
+	csv_converter *converters;
+	int nchunks;
+	csv_record *first[CSV_MAX_THREADS]; // First record of each chunk
+	int count[CSV_MAX_THREADS];         // # of records in each chunk
+	stats_state *states;                // ncols states for each chunk
+} stats_job;
+
+// Adds the statistics of b to those of a
+static void merge_state( stats_state *a, stats_state *b ){
+	double delta, n;
+	a->invalid += b->invalid;
+	if( !b->count )
+		return;
+	if( !a->count ){
+		a->count = b->count;
+		a->min = b->min;
+		a->max = b->max;
+		a->mean = b->mean;
+		a->m2 = b->m2;
+		return;
+	}
+	n = (double) a->count + b->count;
+	delta = b->mean - a->mean;
+	a->mean += delta * b->count / n;
+	a->m2 += b->m2 + delta * delta * a->count * b->count / n;
+	a->count += b->count;
+	if( b->min < a->min )
+		a->min = b->min;
+	if( b->max > a->max )
+		a->max = b->max;
+}
+
+// Adds a block of n valid values to the statistics of a field
+static void add_block( stats_state *state, double *x, int n ){
+	stats_state block;
+	double sum, min, max, d, m2;
+	int i;
+	if( !n )
+		return;
+	sum = 0;
+	min = max = x[0];
+	for( i = 0; i < n; i++ ){
+		sum += x[i];
+		min = x[i] < min ? x[i] : min;
+		max = x[i] > max ? x[i] : max;
+	}
+	block.mean = sum / n;
+	// Deviations from the block mean keep the squares small
+	m2 = 0;
+	for( i = 0; i < n; i++ ){
+		d = x[i] - block.mean;
+		m2 += d * d;
+	}
+	block.count = n;
+	block.invalid = 0;
+	block.min = min;
+	block.max = max;
+	block.m2 = m2;
+	merge_state( state, &block );
+}
+
+// Computes the statistics of the records of chunks lo through hi - 1
+static void scan_chunks( void *arg, int lo, int hi ){
+	stats_job *job = (stats_job *) arg;
+	stats_state *states;
+	csv_record *rec;
+	double *blocks, *block;
+	int *fill;
+	double x;
+	int c, i, j;
+	blocks = (double *) malloc( (size_t) job->ncols * KERNEL_BLOCK * sizeof( double ) );
+	fill = (int *) malloc( job->ncols * sizeof( int ) );
+	for( c = lo; c < hi; c++ ){
+		states = job->states + (size_t) c * job->ncols;
+		memset( fill, 0, job->ncols * sizeof( int ) );
+		rec = job->first[c];
+		for( i = 0; i < job->count[c]; i++, rec = rec->next ){
+			for( j = 0; j < job->ncols; j++ ){
+				x = csv_convert_cell( job->converters + j, rec->record[job->fields[j]] );
+				// NaN and infinities are counted but left out
+				if( x - x != 0 ){
+					states[j].invalid++;
+					continue;
+				}
+				block = blocks + (size_t) j * KERNEL_BLOCK;
+				block[fill[j]++] = x;
+				if( fill[j] == KERNEL_BLOCK ){
+					add_block( states + j, block, KERNEL_BLOCK );
+					fill[j] = 0;
+				}
+			}
+		}
+		for( j = 0; j < job->ncols; j++ )
+			add_block( states + j, blocks + (size_t) j * KERNEL_BLOCK, fill[j] );
+	}
+	free( blocks );
+	free( fill );
+}
+
+// Computes the statistics of the ncols fields named in columns in a
+// single scan of the table; returns an array of ncols statistics to
+// be freed with free(), or NULL if ncols is negative or a field does
+// not exist or is a string field
+csv_stats *csv_multi_column_stats( csv_table *table, int ncols, char **columns ){
+	stats_job *job;
+	stats_state *total;
+	csv_stats *stats;
+	int i, f, c;
+
+	if( ncols < 0 )
+	// Error: Invalid number of columns
+		return NULL;
+	job = (stats_job *) calloc( 1, sizeof( stats_job ) );
+	job->fields = (int *) malloc( (ncols ? ncols : 1) * sizeof( int ) );
+	job->converters = (csv_converter *) malloc( (ncols ? ncols : 1) * sizeof( csv_converter ) );
+	for( i = 0; i < ncols; i++ ){
+		for( f = 0; f < table->rlen; f++ ){
+			if( !strcmp( table->header[f]->name, columns[i] ) )
+				break;
+		}
+		if( f == table->rlen || table->header[f]->type == csv_string ){
+		// Error: Name not found or type mismatch
+			free( job->fields );
+			free( job->converters );
+			free( job );
+			return NULL;
+		}
+		job->fields[i] = f;
+		csv_prepare_converter( table, f, job->converters + i );
+	}
+	job->table = table;
+	job->ncols = ncols;
+	job->nchunks = csv_zone_chunks( table, CSV_MAX_THREADS, job->first, job->count );
+	job->states = (stats_state *) calloc( (size_t) job->nchunks * (ncols ? ncols : 1), sizeof( stats_state ) );
+	csv_parallel_for( job->nchunks, scan_chunks, job );
+
+	// Combine the chunks in table order
+	stats = (csv_stats *) calloc( ncols ? ncols : 1, sizeof( csv_stats ) );
+	for( i = 0; i < ncols; i++ ){
+		total = job->states + i;
+		for( c = 1; c < job->nchunks; c++ )
+			merge_state( total, job->states + (size_t) c * ncols + i );
+		stats[i].count = total->count;
+		stats[i].invalid = total->invalid;
+		stats[i].min = total->min;
+		stats[i].max = total->max;
+		stats[i].mean = total->mean;
+		stats[i].variance = total->count > 1 ? total->m2 / (total->count - 1) : 0;
+	}
+	free( job->states );
+	free( job->fields );
+	free( job->converters );
+	free( job );
+	return stats;
+}
+
+// Computes the statistics of the field given by name; returns a
+// structure to be freed with free(), or NULL if the field does not
+// exist or is a string field
+csv_stats *csv_column_stats( csv_table *table, char *column ){
+	return csv_multi_column_stats( table, 1, &column );
+}
@@ -12,6 +12,9 @@
 #include <string.h>
 #include "csv.h"
 #include "dfloat.h"
+#include "kernels.h"
+#include "index.h"
+#include "zone.h"
 
 // Select next record
 // Return NULL if end of table is reached
@@ -23,6 +26,17 @@ csv_record *csv_next_record( csv_table *table ){
         return NULL;
 }
 
+// Count the records in the table without moving the
+// Current Record Pointer
+int csv_count_records( csv_table *table ){
+        csv_record *rec;
+        int rcount;
+        rcount = 0;
+        for( rec = table->start->next; rec; rec = rec->next )
+                rcount++;
+        return rcount;
+}
+
 // Rewind to the beginning of the table
 void csv_rewind( csv_table *table ){
         table->cur = table->start;
@@ -33,18 +47,31 @@ void csv_drop_table( csv_table *table ){
         csv_record *tmp;
         int f;
 
+        // Field names are shared with other tables unless the table
+        // owns them; the fields themselves were copied by csv_create_table()
+        for( f = 0; f < table->rlen; f++ ){
+                if( table->own_names )
+                        free( table->header[f]->name );
+                free( table->header[f] );
+        }
         free( table->header );
+        csv_drop_indexes( table );
+        csv_drop_zones( table );
+        free( table->fixed );
+        free( table->scales );
 
         // Free table records:
-        csv_rewind( table );
-        while( csv_next_record( table ) ){
-                for( f = 0; f < table->rlen; f++ ){
+        table->cur = table->start->next;
+        while( table->cur ){
+                for( f = 0; f < table->rlen && !table->view; f++ ){
                         free( table->cur->record[f] );
                 }
+                free( table->cur->record );
                 tmp = table->cur;
                 table->cur = table->cur->next;
                 free( tmp );
         }
+        free( table->start );
 
         // Next part prevents dangling pointer problems.
         table->start = NULL;
@@ -65,50 +92,156 @@ csv_table *csv_create_table( int rlen, csv_field **field_vector ){
                 table->header[f] = (csv_field *) malloc( sizeof( csv_field ) );
                 memcpy( table->header[f], field_vector[f], sizeof( csv_field ) );
         }
-        table->start = (csv_record *) malloc( sizeof( csv_record ) );
+        table->start = (csv_record *) calloc( 1, sizeof( csv_record ) );
         table->cur = table->start;
+        table->indexes = NULL;
+        table->zones = NULL;
+        table->zcount = 0;
+        table->view = false;
+        table->own_names = false;
+        table->fixed = NULL;
+        table->scales = NULL;
 	return table;
 }
 
+// Stores field f of a table in fixed point if it is a number field
+// whose values all fit a 32-bit mantissa at the smallest exponent in
+// the column: comparisons and sums on the field then take every
+// mantissa at that exponent instead of normalizing the values. The
+// cells themselves are left as they are, so that they are written
+// back exactly as they were read.
+bool csv_fix_field( csv_table *table, int f ){
+        csv_record *rec;
+        dfloat64_t val;
+        int32_t e;
+        bool seen;
+        if( table->header[f]->type != csv_number || table->view )
+        // Error: Type mismatch or read-only table
+                return false;
+        if( csv_is_fixed( table, f ) )
+                return true;
+        // Find the scale, ignoring zeros, whose exponent is meaningless
+        e = 0;
+        seen = false;
+        for( rec = table->start->next; rec; rec = rec->next ){
+                val = *(dfloat64_t *) rec->record[f];
+                if( val.mantissa && (!seen || val.exponent < e) )
+                        e = val.exponent;
+                seen = seen || val.mantissa;
+        }
+        // Make sure every value fits at that exponent
+        for( rec = table->start->next; rec; rec = rec->next ){
+                val = *(dfloat64_t *) rec->record[f];
+                if( !csv_rescale( &val, e ) )
+                        return false;
+        }
+        if( !table->fixed ){
+                table->fixed = (bool *) calloc( table->rlen, sizeof( bool ) );
+                table->scales = (int32_t *) calloc( table->rlen, sizeof( int32_t ) );
+        }
+        table->fixed[f] = true;
+        table->scales[f] = e;
+        return true;
+}
+
+// Stores the number field given by name in fixed point; returns false
+// if it does not exist, is not a number field, or has values that do
+// not fit a 32-bit mantissa at a common exponent
+bool csv_fix_column( csv_table *table, char *name ){
+        int f;
+        for( f = 0; f < table->rlen; f++ ){
+                if( !strcmp( table->header[f]->name, name ) )
+                        break;
+        }
+        if( f == table->rlen )
+        // Error: Name not found
+                return false;
+        return csv_fix_field( table, f );
+}
+
+// Marks the fields of dst fixed where they are fixed in src; dst must
+// have the same fields and be filled with cells copied from src
+void csv_copy_fixed( csv_table *dst, csv_table *src ){
+        if( !src->fixed || dst->view )
+                return;
+        if( !dst->fixed ){
+                dst->fixed = (bool *) calloc( dst->rlen, sizeof( bool ) );
+                dst->scales = (int32_t *) calloc( dst->rlen, sizeof( int32_t ) );
+        }
+        memcpy( dst->fixed, src->fixed, dst->rlen * sizeof( bool ) );
+        memcpy( dst->scales, src->scales, dst->rlen * sizeof( int32_t ) );
+}
+
+// Gives up fixed point for a field if a new value of it does not fit
+// the scale of the field
+static void keep_scale( csv_table *table, int f, dfloat64_t *val ){
+        dfloat64_t copy;
+        copy = *val;
+        if( csv_is_fixed( table, f ) && !csv_rescale( &copy, table->scales[f] ) )
+                table->fixed[f] = false;
+}
+
 // Equivalent to INSERT INTO in SQL
 void csv_insert_record( csv_table *table, void **record ){
         csv_record *save;
         int f;
         int len;
+        if( table->view )
+        // Error: Views are read-only
+                return;
         save = table->cur;
         while( csv_next_record( table ) );
         table->cur->next = (csv_record *) calloc( 1, sizeof( csv_record ) );
+        table->cur->next->row = (table->cur == table->start) ? 0 : table->cur->row + 1;
         csv_next_record( table );
         table->cur->record = (void **) calloc( table->rlen, sizeof( void * ) );
         for( f = 0; f < table->rlen; f++ ){
                 if( table->header[f]->type == csv_number ){
                         table->cur->record[f] = malloc( sizeof( dfloat64_t ) );
                         memcpy( table->cur->record[f], record[f], sizeof( dfloat64_t ) );
+                        keep_scale( table, f, (dfloat64_t *) table->cur->record[f] );
                 }
                 else if( table->header[f]->type == csv_string ){
                         len = strlen( (char *) record[f] );
                         table->cur->record[f] = malloc( len + 1 );
                         strncpy( table->cur->record[f], record[f], len + 1 );
                 }
+                else
+                        table->cur->record[f] = csv_copy_cell( table->header[f]->type, record[f] );
         }
         table->cur->next = NULL;
+        csv_index_add( table, table->cur, ALL_FIELDS );
+        csv_zone_add( table, table->cur );
         table->cur = save;
 }
 
 // INSERT a blank record and move to that record
 void csv_insert_new_record( csv_table *table ){
         int f;
+        if( table->view )
+        // Error: Views are read-only
+                return;
         while( csv_next_record( table ) );
         table->cur->next = (csv_record *) calloc( 1, sizeof( csv_record ) );
+        table->cur->next->row = (table->cur == table->start) ? 0 : table->cur->row + 1;
         csv_next_record( table );
         table->cur->record = (void **) calloc( table->rlen, sizeof( void * ) );
+        // Fields start out as zero and the empty string
         for( f = 0; f < table->rlen; f++ ){
-                if( table->header[f]->type == csv_number )
-                        table->cur->record[f] = malloc( sizeof( dfloat64_t ) );
+                if( table->header[f]->type == csv_number ){
+                        table->cur->record[f] = calloc( 1, sizeof( dfloat64_t ) );
+                        keep_scale( table, f, (dfloat64_t *) table->cur->record[f] );
+                }
                 else if( table->header[f]->type == csv_string )
-                        table->cur->record[f] = malloc( 1 );
+                        table->cur->record[f] = calloc( 1, 1 );
+                else if( table->header[f]->type == csv_int64 )
+                        table->cur->record[f] = calloc( 1, sizeof( int64_t ) );
+                else if( table->header[f]->type == csv_double )
+                        table->cur->record[f] = calloc( 1, sizeof( double ) );
         }
         table->cur->next = NULL;
+        csv_index_add( table, table->cur, ALL_FIELDS );
+        csv_zone_add( table, table->cur );
 }
 
 // Equivalent to DELETE FROM in SQL except it deletes the
@@ -123,14 +256,21 @@ void csv_delete_current_record( csv_table *table ){
                 tmp1 = tmp1->next;
         if( table->cur->next )
                 tmp2 = table->cur->next;
-        for( f = 0; f < table->rlen; f++ )
+        csv_index_remove( table, table->cur, ALL_FIELDS );
+        csv_zone_remove( table, table->cur );
+        // The cells of a view belong to other tables
+        for( f = 0; f < table->rlen && !table->view; f++ )
                 free( table->cur->record[f] );
+        free( table->cur->record );
         free( table->cur );
         if( tmp2 )
                 tmp1->next = tmp2;
         else
                 tmp1->next = NULL;
         table->cur = tmp1;
+        // Renumber the records that follow
+        for( ; tmp2; tmp2 = tmp2->next )
+                tmp2->row--;
 }
 
 // Used to retrieve numeric values from the table
@@ -206,6 +346,9 @@ char *csv_get_string_field_by_index( csv_table *table, int index ){
 // Used to set the value of a number field
 void csv_set_number_field_by_name( csv_table *table, char *name, dfloat64_t *val ){
         int f;
+        if( table->view )
+        // Error: Views are read-only
+                return;
         for( f = 0; f < table->rlen; f++ ){
                 if( !strcmp( table->header[f]->name, name ) )
                         break;
@@ -216,24 +359,38 @@ void csv_set_number_field_by_name( csv_table *table, char *name, dfloat64_t *val
         if( table->header[f]->type != csv_number )
         // Error: Type mismatch
                 return;
+        csv_index_remove( table, table->cur, f );
         memcpy( table->cur->record[f], val, sizeof( dfloat64_t ) );
+        keep_scale( table, f, (dfloat64_t *) table->cur->record[f] );
+        csv_index_add( table, table->cur, f );
+        csv_zone_update( table, table->cur, f );
 }
 
 // Used to set the value of a number field
 void csv_set_number_field_by_index( csv_table *table, int index, dfloat64_t *val ){
+        if( table->view )
+        // Error: Views are read-only
+                return;
         if( index < 0 || index >= table->rlen )
         // Error: Out-of-bounds
                 return;
         if( table->header[index]->type != csv_number )
         // Error: Type mismatch
                 return;
+        csv_index_remove( table, table->cur, index );
         memcpy( table->cur->record[index], val, sizeof( dfloat64_t ) );
+        keep_scale( table, index, (dfloat64_t *) table->cur->record[index] );
+        csv_index_add( table, table->cur, index );
+        csv_zone_update( table, table->cur, index );
 }
 
 // Used to set the value of a string field
 void csv_set_string_field_by_name( csv_table *table, char *name, char *val ){
         int f;
         int len;
+        if( table->view )
+        // Error: Views are read-only
+                return;
         for( f = 0; f < table->rlen; f++ ){
                 if( !strcmp( table->header[f]->name, name ) )
                         break;
@@ -244,21 +401,174 @@ void csv_set_string_field_by_name( csv_table *table, char *name, char *val ){
         if( table->header[f]->type != csv_string )
         // Error: Type mismatch
                 return;
+        csv_index_remove( table, table->cur, f );
         len = strlen( val );
         table->cur->record[f] = realloc( table->cur->record[f], len + 1 );
         strncpy( table->cur->record[f], val, len + 1 );
+        csv_index_add( table, table->cur, f );
+        csv_zone_update( table, table->cur, f );
 }
 
 // Used to set the value of a string field
 void csv_set_string_field_by_index( csv_table *table, int index, char *val ){
         int len;
+        if( table->view )
+        // Error: Views are read-only
+                return;
         if( index < 0 || index >= table->rlen )
         // Error: Out-of-bounds
                 return;
         if( table->header[index]->type != csv_string )
         // Error: Type mismatch
                 return;
+        csv_index_remove( table, table->cur, index );
         len = strlen( val );
         table->cur->record[index] = realloc( table->cur->record[index], len + 1 );
         strncpy( table->cur->record[index], val, len + 1 );
+        csv_index_add( table, table->cur, index );
+        csv_zone_update( table, table->cur, index );
+}
+
+// Used to retrieve 64-bit integer values from the table
+int64_t *csv_get_int64_field_by_name( csv_table *table, char *name ){
+        int64_t *val;
+        int f;
+        for( f = 0; f < table->rlen; f++ ){
+                if( !strcmp( table->header[f]->name, name ) )
+                        break;
+        }
+        if( f == table->rlen )
+        // Error: Name not found
+                return NULL;
+        if( table->header[f]->type != csv_int64 )
+        // Error: Type mismatch
+                return NULL;
+        val = (int64_t *) malloc( sizeof( int64_t ) );
+        memcpy( val, table->cur->record[f], sizeof( int64_t ) );
+        return val;
+}
+
+// Used to retrieve 64-bit integer values from the table
+int64_t *csv_get_int64_field_by_index( csv_table *table, int index ){
+        int64_t *val;
+        if( index < 0 || index >= table->rlen )
+        // Error: Out-of-bounds
+                return NULL;
+        if( table->header[index]->type != csv_int64 )
+        // Error: Type mismatch
+                return NULL;
+        val = (int64_t *) malloc( sizeof( int64_t ) );
+        memcpy( val, table->cur->record[index], sizeof( int64_t ) );
+        return val;
+}
+
+// Used to set the value of an int64 field
+void csv_set_int64_field_by_name( csv_table *table, char *name, int64_t val ){
+        int f;
+        if( table->view )
+        // Error: Views are read-only
+                return;
+        for( f = 0; f < table->rlen; f++ ){
+                if( !strcmp( table->header[f]->name, name ) )
+                        break;
+        }
+        if( f == table->rlen )
+        // Error: Name not found
+                return;
+        if( table->header[f]->type != csv_int64 )
+        // Error: Type mismatch
+                return;
+        csv_index_remove( table, table->cur, f );
+        memcpy( table->cur->record[f], &val, sizeof( int64_t ) );
+        csv_index_add( table, table->cur, f );
+        csv_zone_update( table, table->cur, f );
+}
+
+// Used to set the value of an int64 field
+void csv_set_int64_field_by_index( csv_table *table, int index, int64_t val ){
+        if( table->view )
+        // Error: Views are read-only
+                return;
+        if( index < 0 || index >= table->rlen )
+        // Error: Out-of-bounds
+                return;
+        if( table->header[index]->type != csv_int64 )
+        // Error: Type mismatch
+                return;
+        csv_index_remove( table, table->cur, index );
+        memcpy( table->cur->record[index], &val, sizeof( int64_t ) );
+        csv_index_add( table, table->cur, index );
+        csv_zone_update( table, table->cur, index );
+}
+
+// Used to retrieve floating-point values from the table
+double *csv_get_double_field_by_name( csv_table *table, char *name ){
+        double *val;
+        int f;
+        for( f = 0; f < table->rlen; f++ ){
+                if( !strcmp( table->header[f]->name, name ) )
+                        break;
+        }
+        if( f == table->rlen )
+        // Error: Name not found
+                return NULL;
+        if( table->header[f]->type != csv_double )
+        // Error: Type mismatch
+                return NULL;
+        val = (double *) malloc( sizeof( double ) );
+        memcpy( val, table->cur->record[f], sizeof( double ) );
+        return val;
+}
+
+// Used to retrieve floating-point values from the table
+double *csv_get_double_field_by_index( csv_table *table, int index ){
+        double *val;
+        if( index < 0 || index >= table->rlen )
+        // Error: Out-of-bounds
+                return NULL;
+        if( table->header[index]->type != csv_double )
+        // Error: Type mismatch
+                return NULL;
+        val = (double *) malloc( sizeof( double ) );
+        memcpy( val, table->cur->record[index], sizeof( double ) );
+        return val;
+}
+
+// Used to set the value of a double field
+void csv_set_double_field_by_name( csv_table *table, char *name, double val ){
+        int f;
+        if( table->view )
+        // Error: Views are read-only
+                return;
+        for( f = 0; f < table->rlen; f++ ){
+                if( !strcmp( table->header[f]->name, name ) )
+                        break;
+        }
+        if( f == table->rlen )
+        // Error: Name not found
+                return;
+        if( table->header[f]->type != csv_double )
+        // Error: Type mismatch
+                return;
+        csv_index_remove( table, table->cur, f );
+        memcpy( table->cur->record[f], &val, sizeof( double ) );
+        csv_index_add( table, table->cur, f );
+        csv_zone_update( table, table->cur, f );
+}
+
+// Used to set the value of a double field
+void csv_set_double_field_by_index( csv_table *table, int index, double val ){
+        if( table->view )
+        // Error: Views are read-only
+                return;
+        if( index < 0 || index >= table->rlen )
+        // Error: Out-of-bounds
+                return;
+        if( table->header[index]->type != csv_double )
+        // Error: Type mismatch
+                return;
+        csv_index_remove( table, table->cur, index );
+        memcpy( table->cur->record[index], &val, sizeof( double ) );
+        csv_index_add( table, table->cur, index );
+        csv_zone_update( table, table->cur, index );
 }
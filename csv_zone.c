@@ -0,0 +1,303 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Zone maps for skipping     *
+ *                 blocks of records          *
+ **********************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "csv.h"
+#include "dfloat.h"
+#include "index.h"
+#include "zone.h"
+
+/*
+ * A zone map divides a table into zones of ZONE_SIZE consecutive
+ * records and keeps the minimum and maximum of every number, int64
+ * and double field and a Bloom filter of every string field for each zone. Selection
+ * functions test their condition against these statistics first
+ * and skip zones that cannot contain a match, or select zones in
+ * which every record must match without looking at the records.
+ *
+ * Insertions and updates widen the statistics of the affected
+ * zone. Deleting a record shifts every following record back by
+ * one row, so each following zone absorbs the statistics of the
+ * next one; the statistics stay correct but may become loose after
+ * many deletions, which csv_analyze_table() corrects.
+ */
+
+// Size of each Bloom filter; the filters use three hash functions
+#define BLOOM_BITS 2048
+#define BLOOM_BYTES (BLOOM_BITS / 8)
+#define BLOOM_MASK (BLOOM_BITS - 1)
+
+// Adds a string to a Bloom filter
+static void bloom_add( uint8_t *bloom, char *str ){
+	uint64_t h;
+	h = csv_hash_bytes( str, strlen( str ) );
+	bloom[(h & BLOOM_MASK) >> 3] |= 1 << (h & 7);
+	bloom[((h >> 21) & BLOOM_MASK) >> 3] |= 1 << ((h >> 21) & 7);
+	bloom[((h >> 42) & BLOOM_MASK) >> 3] |= 1 << ((h >> 42) & 7);
+}
+
+// Returns false if a string is definitely not in a Bloom filter
+static bool bloom_test( uint8_t *bloom, char *str ){
+	uint64_t h;
+	h = csv_hash_bytes( str, strlen( str ) );
+	return (bloom[(h & BLOOM_MASK) >> 3] & (1 << (h & 7)))
+	    && (bloom[((h >> 21) & BLOOM_MASK) >> 3] & (1 << ((h >> 21) & 7)))
+	    && (bloom[((h >> 42) & BLOOM_MASK) >> 3] & (1 << ((h >> 42) & 7)));
+}
+
+// Widens the statistics of a zone to include a value of a record;
+// the first record of a zone initializes the minimum and maximum.
+// A NaN makes both bounds of its double field NaN for good, since
+// it compares false with everything
+static void include_value( csv_table *table, csv_zone *zone, csv_record *rec, int f ){
+	dfloat64_t *val;
+	int64_t x;
+	double u;
+	bool first;
+	first = zone->count == 1;
+	switch( table->header[f]->type ){
+		case csv_number :
+			val = (dfloat64_t *) rec->record[f];
+			if( first || dfloat64_cmp( val, &zone->min[f].number ) < 0 )
+				zone->min[f].number = *val;
+			if( first || dfloat64_cmp( val, &zone->max[f].number ) > 0 )
+				zone->max[f].number = *val;
+			break;
+		case csv_int64 :
+			x = *(int64_t *) rec->record[f];
+			if( first || x < zone->min[f].integer )
+				zone->min[f].integer = x;
+			if( first || x > zone->max[f].integer )
+				zone->max[f].integer = x;
+			break;
+		case csv_double :
+			u = *(double *) rec->record[f];
+			if( first || u < zone->min[f].real || u != u )
+				zone->min[f].real = u;
+			if( first || u > zone->max[f].real || u != u )
+				zone->max[f].real = u;
+			break;
+		default :
+			bloom_add( zone->bloom[f], (char *) rec->record[f] );
+			break;
+	}
+}
+
+// Widens the statistics of dst to include those of src
+static void merge_zone( csv_table *table, csv_zone *dst, csv_zone *src ){
+	int f, i;
+	for( f = 0; f < table->rlen; f++ ){
+		switch( table->header[f]->type ){
+			case csv_number :
+				if( dfloat64_cmp( &src->min[f].number, &dst->min[f].number ) < 0 )
+					dst->min[f] = src->min[f];
+				if( dfloat64_cmp( &src->max[f].number, &dst->max[f].number ) > 0 )
+					dst->max[f] = src->max[f];
+				break;
+			case csv_int64 :
+				if( src->min[f].integer < dst->min[f].integer )
+					dst->min[f] = src->min[f];
+				if( src->max[f].integer > dst->max[f].integer )
+					dst->max[f] = src->max[f];
+				break;
+			case csv_double :
+				if( src->min[f].real < dst->min[f].real || src->min[f].real != src->min[f].real )
+					dst->min[f] = src->min[f];
+				if( src->max[f].real > dst->max[f].real || src->max[f].real != src->max[f].real )
+					dst->max[f] = src->max[f];
+				break;
+			default :
+				for( i = 0; i < BLOOM_BYTES; i++ )
+					dst->bloom[f][i] |= src->bloom[f][i];
+				break;
+		}
+	}
+}
+
+// Frees the statistics of a zone
+static void free_zone( csv_table *table, csv_zone *zone ){
+	int f;
+	for( f = 0; f < table->rlen; f++ )
+		free( zone->bloom[f] );
+	free( zone->bloom );
+	free( zone->min );
+	free( zone->max );
+}
+
+// Adds a record appended to the end of a table to the zone map
+void csv_zone_add( csv_table *table, csv_record *rec ){
+	csv_zone *zone;
+	int f;
+	if( !table->zcount || table->zones[table->zcount-1].count == ZONE_SIZE ){
+		// Start a new zone, doubling the array whenever the
+		// number of zones reaches a power of two
+		if( !(table->zcount & (table->zcount - 1)) )
+			table->zones = (csv_zone *) realloc( table->zones, (table->zcount ? table->zcount << 1 : 1) * sizeof( csv_zone ) );
+		zone = table->zones + table->zcount++;
+		zone->first = rec;
+		zone->count = 0;
+		zone->min = (csv_bound *) calloc( table->rlen, sizeof( csv_bound ) );
+		zone->max = (csv_bound *) calloc( table->rlen, sizeof( csv_bound ) );
+		zone->bloom = (uint8_t **) calloc( table->rlen, sizeof( uint8_t * ) );
+		for( f = 0; f < table->rlen; f++ ){
+			if( table->header[f]->type == csv_string )
+				zone->bloom[f] = (uint8_t *) calloc( BLOOM_BYTES, 1 );
+		}
+	}
+	zone = table->zones + table->zcount - 1;
+	zone->count++;
+	for( f = 0; f < table->rlen; f++ )
+		include_value( table, zone, rec, f );
+}
+
+// Widens the zone of a record after one of its fields has changed
+void csv_zone_update( csv_table *table, csv_record *rec, int field ){
+	if( rec->row / ZONE_SIZE < table->zcount )
+		include_value( table, table->zones + rec->row / ZONE_SIZE, rec, field );
+}
+
+// Adjusts the zone map for the deletion of a record; must be
+// called while the record is still linked into the table
+void csv_zone_remove( csv_table *table, csv_record *rec ){
+	csv_zone *zones;
+	int z, zr;
+	zones = table->zones;
+	zr = rec->row / ZONE_SIZE;
+	if( zr >= table->zcount )
+		return;
+	// Every following record moves back one row, so each zone
+	// from here on picks up the first record of the next one
+	for( z = zr; z < table->zcount - 1; z++ )
+		merge_zone( table, zones + z, zones + z + 1 );
+	for( z = zr + 1; z < table->zcount; z++ )
+		zones[z].first = zones[z].first->next;
+	if( zones[zr].first == rec )
+		zones[zr].first = rec->next;
+	if( --zones[table->zcount-1].count == 0 )
+		free_zone( table, zones + --table->zcount );
+}
+
+// Frees the zone map of a table
+void csv_drop_zones( csv_table *table ){
+	int z;
+	for( z = 0; z < table->zcount; z++ )
+		free_zone( table, table->zones + z );
+	free( table->zones );
+	table->zones = NULL;
+	table->zcount = 0;
+}
+
+// Returns the number of records covered by the zone map
+int csv_zone_rows( csv_table *table ){
+	if( !table->zcount )
+		return 0;
+	return (table->zcount - 1) * ZONE_SIZE + table->zones[table->zcount-1].count;
+}
+
+// Divides a table into at most max chunks of whole zones for
+// processing on separate threads, storing the first record and the
+// number of records of each chunk; returns the number of chunks
+int csv_zone_chunks( csv_table *table, int max, csv_record **first, int *count ){
+	int c, z, zlo, zhi, nchunks;
+	if( !table->zcount ){
+		first[0] = table->start->next;
+		count[0] = csv_count_records( table );
+		return 1;
+	}
+	nchunks = table->zcount < max ? table->zcount : max;
+	for( c = 0; c < nchunks; c++ ){
+		zlo = (int) ((int64_t) table->zcount * c / nchunks);
+		zhi = (int) ((int64_t) table->zcount * (c + 1) / nchunks);
+		first[c] = table->zones[zlo].first;
+		count[c] = 0;
+		for( z = zlo; z < zhi; z++ )
+			count[c] += table->zones[z].count;
+	}
+	return nchunks;
+}
+
+// Equivalent to ANALYZE in SQL; rebuilds the zone map of a table
+// so that its statistics are exact again
+void csv_analyze_table( csv_table *table ){
+	csv_record *rec;
+	csv_drop_zones( table );
+	for( rec = table->start->next; rec; rec = rec->next )
+		csv_zone_add( table, rec );
+}
+
+// Decides a comparison for a whole zone from the comparisons lo and
+// hi of its minimum and maximum with the operand
+static enum zone_results decide( enum operators operator, int lo, int hi ){
+	switch( operator ){
+		case EQ :
+			if( lo > 0 || hi < 0 ) return ZONE_NEVER;
+			if( lo == 0 && hi == 0 ) return ZONE_ALWAYS;
+			break;
+		case NE :
+			if( lo > 0 || hi < 0 ) return ZONE_ALWAYS;
+			if( lo == 0 && hi == 0 ) return ZONE_NEVER;
+			break;
+		case LT :
+			if( hi < 0 ) return ZONE_ALWAYS;
+			if( lo >= 0 ) return ZONE_NEVER;
+			break;
+		case LE :
+			if( hi <= 0 ) return ZONE_ALWAYS;
+			if( lo > 0 ) return ZONE_NEVER;
+			break;
+		case GT :
+			if( lo > 0 ) return ZONE_ALWAYS;
+			if( hi <= 0 ) return ZONE_NEVER;
+			break;
+		case GE :
+			if( lo >= 0 ) return ZONE_ALWAYS;
+			if( hi < 0 ) return ZONE_NEVER;
+			break;
+		default :
+			break;
+	}
+	return ZONE_MAYBE;
+}
+
+// Tests whether the records of a zone can satisfy a prepared predicate
+enum zone_results csv_zone_test( csv_table *table, csv_zone *zone, csv_predicate *pred ){
+	csv_bound *min, *max;
+	enum operators operator;
+	int f;
+	f = pred->field;
+	operator = pred->operator;
+	min = zone->min + f;
+	max = zone->max + f;
+	switch( table->header[f]->type ){
+		case csv_string :
+			// The Bloom filter can only prove that a value is absent
+			if( (operator == SEQ || operator == SNE) && !bloom_test( zone->bloom[f], pred->string ) )
+				return operator == SEQ ? ZONE_NEVER : ZONE_ALWAYS;
+			return ZONE_MAYBE;
+		case csv_number :
+			return decide( operator, dfloat64_cmp( &min->number, &pred->number ), dfloat64_cmp( &max->number, &pred->number ) );
+		case csv_int64 :
+			if( !pred->whole && (operator == EQ || operator == NE || pred->real != pred->real) )
+			// Same outcome for every record, as in csv_compare_natives()
+				return operator == NE ? ZONE_ALWAYS : ZONE_NEVER;
+			return decide( operator, (min->integer > pred->integer) - (min->integer < pred->integer),
+			                         (max->integer > pred->integer) - (max->integer < pred->integer) );
+		case csv_double :
+			if( pred->real != pred->real )
+				return operator == NE ? ZONE_ALWAYS : ZONE_NEVER;
+			if( min->real != min->real || max->real != max->real )
+				return ZONE_MAYBE;
+			return decide( operator, (min->real > pred->real) - (min->real < pred->real),
+			                         (max->real > pred->real) - (max->real < pred->real) );
+		default :
+			return ZONE_MAYBE;
+	}
+}
@@ -0,0 +1,81 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Header file for compiled   *
+ *                 selection expressions      *
+ **********************************************/
+
+#ifndef _EXPR_
+#define _EXPR_
+
+#include <stdint.h>
+#include "csv.h"
+#include "dfloat.h"
+
+// Number of records evaluated by each pass of the interpreter,
+// must be a multiple of 8 so batches fill whole bytes of a set
+#define EXPR_BATCH 256
+
+// Types of the values on the interpreter stack
+enum value_types { V_NUMBER, V_STRING, V_TRUTH, V_REAL };
+
+// Opcodes for the expression interpreter
+enum opcodes {
+	OP_FIELD,  // Push field arg of each record
+	OP_NUMBER, // Push numeric constant arg
+	OP_STRING, // Push string constant arg
+	OP_TOREAL, // Convert the number arg slots below the top to a real
+	OP_NEG,    // Negate a number
+	OP_ADD,    // Arithmetic operators on two numbers
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_CMP,    // Compare two values, arg is the operator
+	OP_CMPK,   // Compare field arg to constant k, rel is the operator
+	OP_AND,    // Logical operators on truth values
+	OP_OR,
+	OP_NOT
+};
+
+// Single interpreter instruction
+typedef struct {
+	enum opcodes opcode;
+	enum value_types type; // Type of the operands
+	enum operators rel;    // Operator used by OP_CMP and OP_CMPK
+	int arg;               // Field index or constant index
+	int k;                 // Constant or predicate index used by OP_CMPK
+	enum types cell;       // Type of the cells of field arg
+} expr_instr;
+
+// Compiled expression
+struct _csv_expr {
+	int rlen;          // # of fields in the table it was compiled for
+	expr_instr *code;  // Instructions in postfix order
+	int ncode;
+	dfloat64_t *numbers; // Numeric constants
+	int nnumbers;
+	char **strings;      // String constants
+	int nstrings;
+	csv_predicate *preds; // Comparisons of int64 and double fields to constants
+	int npreds;
+	int depth;           // Maximum stack depth of the program
+};
+
+// Stack slot holding one value for each record of a batch
+typedef union {
+	dfloat64_t number[EXPR_BATCH];
+	char *string[EXPR_BATCH];
+	double real[EXPR_BATCH];
+	uint8_t truth[EXPR_BATCH];
+} expr_slot;
+
+__BEGIN_DECLS
+expr_slot *csv_expr_alloc_stack( csv_expr * );
+void csv_expr_eval_batch( csv_expr *, expr_slot *, void ***, int, uint8_t * );
+__END_DECLS
+
+#endif
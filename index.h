@@ -0,0 +1,39 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Header file for index      *
+ *                 maintenance functions      *
+ **********************************************/
+
+#ifndef _INDEX_
+#define _INDEX_
+
+#include "csv.h"
+#include "dfloat.h"
+
+// Passed as the field to update every index on a table
+#define ALL_FIELDS -1
+
+// Position of a lookup in a hash index
+typedef struct {
+	uint64_t hash; // Hash of the value being looked up
+	int slot;      // Next slot to examine
+} index_cursor;
+
+__BEGIN_DECLS
+csv_index *csv_find_index( csv_table *, int );
+void csv_index_add( csv_table *, csv_record *, int );
+void csv_index_remove( csv_table *, csv_record *, int );
+void csv_drop_indexes( csv_table * );
+int csv_index_lower_bound( csv_index *, void * );
+int csv_index_upper_bound( csv_index *, void * );
+void csv_index_open( csv_index *, char *, index_cursor * );
+csv_record *csv_index_match( csv_index *, char *, index_cursor * );
+uint64_t csv_hash_bytes( const void *, size_t );
+uint64_t csv_hash_cell( csv_table *, int, void * );
+__END_DECLS
+
+#endif
@@ -0,0 +1,78 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Header file for block      *
+ *                 comparison kernels         *
+ **********************************************/
+
+#ifndef _KERNELS_
+#define _KERNELS_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "csv.h"
+#include "dfloat.h"
+
+// Number of values processed by each call to a kernel,
+// a multiple of 8 so that blocks fill whole bytes of a set
+#define KERNEL_BLOCK 1024
+
+// Largest exponent difference that can be scaled away without
+// overflowing a 64-bit integer: 2^31 * 10^9 < 2^63
+#define KERNEL_MAX_SCALE 9
+
+// Largest number of threads used by csv_parallel_for()
+#define CSV_MAX_THREADS 64
+
+// True if the cells of field f of a table all fit a 32-bit mantissa at
+// the exponent in table->scales[f]
+#define csv_is_fixed( table, f ) ((table)->fixed && (table)->fixed[f])
+
+// Exact decimal accumulator used for sums: the value is m * 10^e
+typedef struct {
+	int64_t m;
+	int32_t e;
+} csv_sum;
+
+// Conversion of the cells of a number, int64 or double field to
+// double precision, prepared once for the whole field
+typedef struct {
+	enum types type;
+	bool fixed;    // Fixed-point number field: value is mantissa * power
+	bool divide;   // or mantissa / power if the exponent is negative,
+	int32_t scale; // with the mantissa taken at this exponent
+	double power;  // 10^|exponent|, exact for the exponents of real data
+} csv_converter;
+
+__BEGIN_DECLS
+extern const int csv_cmp_masks[];
+extern const int64_t csv_pow10[];
+bool csv_normalize_block( dfloat64_t **, int, dfloat64_t *, int64_t *, int64_t * );
+void csv_compare_block( int64_t *, int, int64_t, enum operators, uint8_t * );
+void csv_compare_block_double( double *, int, double, enum operators, uint8_t * );
+void csv_compare_block_slow( dfloat64_t **, int, dfloat64_t *, enum operators, uint8_t * );
+void csv_compare_natives( csv_predicate *, void *, int, uint8_t * );
+void csv_integer_operand( csv_predicate *, double );
+void csv_pack_bits( uint8_t *, int, uint8_t * );
+void csv_fill_bits( uint8_t *, int );
+void csv_parallel_for( int, void (*)( void *, int, int ), void * );
+void csv_sum_add( csv_sum *, int64_t, int32_t );
+void csv_sum_to_dfloat( csv_sum *, dfloat64_t * );
+double csv_sum_to_double( csv_sum * );
+double csv_dfloat_to_double( dfloat64_t * );
+void csv_double_to_dfloat( double, dfloat64_t * );
+void *csv_parse_cell( enum types, char * );
+void *csv_copy_cell( enum types, void * );
+int csv_compare_cells( enum types, void *, void * );
+bool csv_rescale( dfloat64_t *, int32_t );
+int32_t csv_fixed_mantissa( dfloat64_t *, int32_t );
+bool csv_fix_field( csv_table *, int );
+void csv_copy_fixed( csv_table *, csv_table * );
+void csv_prepare_converter( csv_table *, int, csv_converter * );
+double csv_convert_cell( csv_converter *, void * );
+__END_DECLS
+
+#endif
@@ -0,0 +1,20 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Header file for internal   *
+ *                 sorting functions          *
+ **********************************************/
+
+#ifndef _SORT_
+#define _SORT_
+
+#include "csv.h"
+
+__BEGIN_DECLS
+void csv_sort_records( csv_table *, int, int *, enum directions *, csv_record **, int );
+__END_DECLS
+
+#endif
@@ -0,0 +1,30 @@
+/**********************************************
+ * libcsv, Version 0.3 Alpha                  *
+ * Description: CSV library for C             *
+ * Author: Michael Warren, a.k.a Psycho Cod3r *
+ * Date: November 2020                        *
+ * License: Michael Warren FSL Version 1.1    *
+ * Current module: Header file for zone map   *
+ *                 maintenance functions      *
+ **********************************************/
+
+#ifndef _ZONE_
+#define _ZONE_
+
+#include "csv.h"
+#include "dfloat.h"
+
+// Results of testing a condition against the statistics of a zone
+enum zone_results { ZONE_NEVER, ZONE_MAYBE, ZONE_ALWAYS };
+
+__BEGIN_DECLS
+void csv_zone_add( csv_table *, csv_record * );
+void csv_zone_update( csv_table *, csv_record *, int );
+void csv_zone_remove( csv_table *, csv_record * );
+void csv_drop_zones( csv_table * );
+int csv_zone_rows( csv_table * );
+int csv_zone_chunks( csv_table *, int, csv_record **, int * );
+enum zone_results csv_zone_test( csv_table *, csv_zone *, csv_predicate * );
+__END_DECLS
+
+#endif